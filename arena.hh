@@ -1,33 +1,135 @@
 #pragma once
+#include <algorithm>
+#include <cassert>
 #include <new>
+#include <vector>
 
 template<typename T>
 class Arena {
-    T* memory;
+    static_assert(sizeof(T) >= sizeof(T*), "released slots must fit a free list link");
+
+    std::vector<T*> chunks;
+    // Chunks sorted by address, for `index_of()`.
+    std::vector<std::pair<T*, std::size_t>> by_address;
+    std::size_t chunk_size;
+    // Bump allocation within the most recent chunk.
     T* free;
     T* end;
+    // Released slots, linked through their first word.
+    T* free_list;
+
+    std::size_t live;
+    std::size_t high_water;
+
+    void grow() {
+        chunks.push_back(static_cast<T*>(::operator new(chunk_size*sizeof(T))));
+        free = chunks.back();
+        end = free + chunk_size;
+
+        std::pair<T*, std::size_t> entry{chunks.back(), chunks.size() - 1};
+        by_address.insert(std::upper_bound(by_address.begin(), by_address.end(), entry), entry);
+    }
 
 public:
     static Arena<T>* current;
     Arena<T>* parent;
 
-    Arena(std::size_t n) : parent(current) {
-        memory = static_cast<T*>(::operator new(n*sizeof(T)));
-        free = memory;
-        end = memory + n;
+    /**
+     * Create an arena that grows `chunk_size` slots at a time and make
+     * it the current arena.
+     */
+    Arena(std::size_t chunk_size)
+        : chunk_size(chunk_size), free(nullptr), end(nullptr), free_list(nullptr),
+          live(0), high_water(0), parent(current) {
         current = this;
     }
 
+    Arena(const Arena&) = delete;
+    Arena& operator=(const Arena&) = delete;
+
     ~Arena() {
         current = parent;
-        ::operator delete(memory);
+        for (T* chunk : chunks)
+            ::operator delete(chunk);
     }
 
     T* alloc() {
-        if (free >= end)
-            throw std::bad_alloc();
-        return free++;
+        T* result;
+        if (free_list != nullptr) {
+            result = free_list;
+            free_list = *reinterpret_cast<T**>(free_list);
+        } else {
+            if (free >= end)
+                grow();
+            result = free++;
+        }
+        high_water = std::max(high_water, ++live);
+        return result;
+    }
+
+    /**
+     * Return a slot to the arena, it is handed out again by `alloc()`.
+     */
+    void release(T* slot) {
+        *reinterpret_cast<T**>(slot) = free_list;
+        free_list = slot;
+        live--;
+    }
+
+    /**
+     * Slots are numbered in allocation order across chunks, only
+     * slots below `used()` have ever been handed out.
+     */
+    std::size_t used() const {
+        if (chunks.empty())
+            return 0;
+        return (chunks.size() - 1) * chunk_size + (free - chunks.back());
+    }
+
+    T* slot(std::size_t index) const {
+        return chunks[index / chunk_size] + index % chunk_size;
+    }
+
+    std::size_t index_of(const T* slot) const {
+        auto it = std::upper_bound(
+            by_address.begin(), by_address.end(), slot,
+            [](const T* s, const std::pair<T*, std::size_t>& chunk) {
+                return s < chunk.first;
+            });
+        assert(it != by_address.begin());
+        --it;
+        assert(slot < it->first + chunk_size);
+        return it->second * chunk_size + (slot - it->first);
     }
+
+    /**
+     * Shrink the arena to its first `n` slots, which the caller has
+     * compacted all live objects into. Forgets the free list and gives
+     * surplus chunks back.
+     */
+    void truncate(std::size_t n) {
+        std::size_t keep = n / chunk_size + 1;
+        while (chunks.size() > keep) {
+            std::pair<T*, std::size_t> entry{chunks.back(), chunks.size() - 1};
+            by_address.erase(std::lower_bound(by_address.begin(), by_address.end(), entry));
+            ::operator delete(chunks.back());
+            chunks.pop_back();
+        }
+        while (chunks.size() < keep)
+            grow();
+
+        free = slot(n);
+        end = chunks.back() + chunk_size;
+        free_list = nullptr;
+        live = n;
+    }
+
+    // Number of allocated slots.
+    std::size_t size() const { return live; }
+    // Number of slots backed by memory.
+    std::size_t capacity() const { return chunks.size() * chunk_size; }
+    // Most slots ever allocated at once.
+    std::size_t high_water_mark() const { return high_water; }
 };
 
 template<typename T>
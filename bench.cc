@@ -0,0 +1,123 @@
+/**
+ * Highlighting benchmark: lines/second of `lex_line()` versus the
+ * std::regex tokenizer it replaced.
+ *
+ *     edit-bench [FILE]
+ *
+ * Without a file a synthetic C-like input is used.
+ */
+#include <algorithm>
+#include <chrono>
+#include <fstream>
+#include <iostream>
+#include <iterator>
+#include <regex>
+#include <string>
+#include <vector>
+
+#include "lexer.hh"
+
+namespace legacy {
+
+bool is_keyword(std::string& s) {
+    return s == "if" || s == "else" || s == "do" || s == "while" || s == "switch"
+        || s == "case"|| s == "default" || s == "break" || s == "continue"
+        || s == "for" || s == "return";
+}
+
+bool is_comment(std::string& s) {
+    return s.size() >= 2 && s[0] == '/' && s[1] == '/';
+}
+
+bool is_type(std::string& s) {
+    return s == "void" || s == "bool" || s == "int";
+}
+
+bool is_cpp(std::string& s) {
+    return s.size() > 0 && s[0] == '#';
+}
+
+bool is_special_literal(std::string& s) {
+    return s == "true" || s == "false";
+}
+
+// The tokenizer `print_highlighted()` used, minus the printing.
+std::size_t highlight(std::string line) {
+    const std::regex token_rx(
+        "[a-zA-Z0-9_]?("
+        "(if)|(else)|(do)|(while)|(switch)|(case)|(default)|(break)|(continue)|(for)|(return)|"
+        "(//.*$)|"
+        "(\\#.* )|"
+        "(void)|(unsigned)|(char)|(bool)|(short)|(int)|(long)|(float)|(double)|"
+        "(true)|(false)"
+        ")[a-zA-Z0-9_]?"
+        );
+    std::vector<std::string> tokens;
+    std::remove_copy_if(
+        std::sregex_token_iterator(line.begin(), line.end(), token_rx, {-1, 0}),
+        std::sregex_token_iterator(),
+        std::back_inserter(tokens),
+        [](std::string const &s) { return s.empty(); });
+
+    std::size_t highlighted = 0;
+    for (auto& token : tokens) {
+        if (is_keyword(token) || is_comment(token) || is_type(token)
+            || is_special_literal(token) || is_cpp(token))
+            highlighted++;
+    }
+    return highlighted;
+}
+
+}
+
+template<typename F>
+void run(const char *name, const std::vector<std::string> &lines, F &&highlight) {
+    using clock = std::chrono::steady_clock;
+    std::size_t highlighted = 0, processed = 0;
+    auto start = clock::now();
+    std::chrono::duration<double> elapsed{};
+    do {
+        for (const std::string &line : lines)
+            highlighted += highlight(line);
+        processed += lines.size();
+        elapsed = clock::now() - start;
+    } while (elapsed.count() < 1.0);
+
+    std::cout << name << ": " << (std::size_t)(processed / elapsed.count())
+              << " lines/s (" << highlighted << " tokens)" << std::endl;
+}
+
+int main(int argc, char *argv[]) {
+    std::vector<std::string> lines;
+    if (argc > 1) {
+        std::ifstream ifs(argv[1]);
+        for (std::string line; std::getline(ifs, line);)
+            lines.push_back(line);
+    } else {
+        const char *sample[] {
+            "#include <stdio.h>",
+            "int main(int argc, char *argv[]) {",
+            "    for (int i = 0; i < argc; i++) {",
+            "        if (argv[i][0] == '-') continue; // Skip flags.",
+            "        printf(\"%s\\n\", argv[i]);",
+            "    }",
+            "    return 0;",
+            "}",
+        };
+        for (int i = 0; i < 1000; i++)
+            lines.insert(lines.end(), std::begin(sample), std::end(sample));
+    }
+
+    run("std::regex", lines, [](const std::string &line) {
+        return legacy::highlight(line);
+    });
+
+    std::vector<Token> tokens;
+    LexState state = LexState::Normal;
+    run("lex_line", lines, [&](const std::string &line) {
+        tokens.clear();
+        state = lex_line(line, state, tokens);
+        return tokens.size();
+    });
+    return 0;
+}
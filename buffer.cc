@@ -5,96 +5,176 @@
 #include <algorithm>
 #include <iterator>
 #include <iostream>
-#include <regex>
+#include <system_error>
 
 #include "buffer.hh"
 #include "frame.hh"
+#include "lexer.hh"
+#include "search.hh"
 
 
-void Buffer::cursor_up() { _row--; clamp_cursor(); }
-void Buffer::cursor_down() { _row++; clamp_cursor(); }
-void Buffer::cursor_left() { _col--; clamp_cursor(); }
-void Buffer::cursor_right() { _col++; clamp_cursor(); }
-
-const std::string keywords[] {
-    "if", "do", "while", "switch", "case"
-};
-
-bool is_keyword(std::string& s) {
-    return s == "if" || s == "else" || s == "do" || s == "while" || s == "switch"
-        || s == "case"|| s == "default" || s == "break" || s == "continue"
-        || s == "for" || s == "return";
-}
-
-bool is_comment(std::string& s) {
-    return s.size() >= 2 && s[0] == '/' && s[1] == '/';
-}
-
-bool is_type(std::string& s) {
-    return s == "void" || s == "bool" || s == "int";
-}
-
-bool is_cpp(std::string& s) {
-    return s.size() > 0 && s[0] == '#';
-}
-
-bool is_special_literal(std::string& s) {
-    return s == "true" || s == "false";
-}
-
-void print_highlighted(std::string line) {
-    // std::istringstream iss(line);
-    // std::copy(std::istream_iterator<std::string>(iss),
-    //           std::istream_iterator<std::string>(),
-    //           std::ostream_iterator<std::string>(std::cout, " "));
-
-    const std::regex token_rx(
-        "[a-zA-Z0-9_]?("
-        // Keywords.
-        "(if)|(else)|(do)|(while)|(switch)|(case)|(default)|(break)|(continue)|(for)|(return)|"
-        // Comments.
-        "(//.*$)|"
-        // C preprocessor.
-        "(\\#.* )|"
-        // Types.
-        "(void)|(unsigned)|(char)|(bool)|(short)|(int)|(long)|(float)|(double)|"
-        // Special values.
-        "(true)|(false)"
-        ")[a-zA-Z0-9_]?"
-        );
-    std::vector<std::string> tokens;
-    std::remove_copy_if(
-        std::sregex_token_iterator(line.begin(), line.end(), token_rx, {-1, 0}),
-        std::sregex_token_iterator(),
-        std::back_inserter(tokens),
-        [](std::string const &s) { return s.empty(); });
-    for (auto& token : tokens) {
-        if (is_keyword(token)) {
-            printf("\e[32m%s\e[0m", token.c_str());
-        } else if (is_comment(token)) {
-            printf("\e[37;1m%s\e[0m", token.c_str());
-        } else if (is_type(token) || is_special_literal(token)) {
-            printf("\e[34m%s\e[0m", token.c_str());
-        } else if (is_cpp(token)) {
-            printf("\e[34;1m%s\e[0m", token.c_str());
+void Buffer::mark_lines(int first, int last) {
+    // Swallow every interval overlapping or touching [first, last).
+    auto it = _damage.begin();
+    while (it != _damage.end()) {
+        if (it->second < first || last < it->first) {
+            ++it;
         } else {
-            printf("%s", token.c_str());
+            first = std::min(first, it->first);
+            last = std::max(last, it->second);
+            it = _damage.erase(it);
         }
     }
+    _damage.emplace_back(first, last);
 }
 
-bool StringBuffer::draw(int x0, int y0, int x1, int y1) {
+void Buffer::move_to_row(int row) {
+    int display = display_col(_row, _col);
+    load_lines(row + 1);
+    _row = std::min(max_row(), std::max(min_row(), row));
+    _col = byte_col(_row, display);
+    clamp_cursor();
+}
+
+void Buffer::cursor_up() { move_to_row(_row - 1); }
+void Buffer::cursor_down() { move_to_row(_row + 1); }
+void Buffer::cursor_left() { _col = prev_col(_row, _col); clamp_cursor(); }
+void Buffer::cursor_right() { _col = next_col(_row, _col); clamp_cursor(); }
+
+static int page_height() {
+    return active_frame().text_rows();
+}
+
+void Buffer::page_up() {
+    _top = std::max(min_row(), _top - page_height());
+    move_to_row(_row - page_height());
+    mark_for_update();
+}
+
+void Buffer::page_down() {
+    load_lines(_top + 2 * page_height());
+    _top = std::max(min_row(), std::min(max_row(), _top + page_height()));
+    move_to_row(_row + page_height());
+    mark_for_update();
+}
+
+void Buffer::scroll_to_cursor() {
+    int top = _top;
+    if (_row < top)
+        top = _row;
+    else if (_row >= top + page_height())
+        top = _row - page_height() + 1;
+
+    if (top != _top) {
+        _top = top;
+        mark_for_update();
+    }
+}
+
+void draw_highlighted(Screen &screen, int row, int x0, int x1,
+                      std::string_view line, const std::vector<Token> &tokens) {
+    int col = x0;
+    std::size_t offset = 0;
+    for (const Token &token : tokens) {
+        col = screen.put(row, col, line.substr(offset, token.start - offset), Face::Default, x1);
+        col = screen.put(row, col, line.substr(token.start, token.length), token.face, x1);
+        offset = token.start + token.length;
+    }
+    screen.put(row, col, line.substr(offset), Face::Default, x1);
+}
+
+bool Buffer::poll_background() {
+    if (_utf8.failed() && !_utf8_reported) {
+        _utf8_reported = true;
+        active_frame().set_status(_path + " is not valid UTF-8, invalid bytes are shown as \uFFFD");
+    }
+
+    auto [first, last] = _highlight_worker.poll(
+        _highlight, [this](std::string_view text) { read_in_background(text); });
+    if (first < last)
+        mark_lines(first, last);
+    return start_highlighting() || _highlight_worker.running();
+}
+
+// Lines lexed per frame on the render path when the rest can be left
+// to the background worker.
+static constexpr std::size_t sync_highlight_lines = 1 << 12;
+// Lines past the view the worker lexes ahead, highlighting further
+// down is dropped and redone once scrolled to.
+static constexpr std::size_t highlight_lookahead = 1 << 14;
+// Lines above the view highlighting starts from, in a state guessed
+// unless the cache already reaches there. Scrolling further away than
+// this rebases the cache, so it doesn't grow with the distance from
+// the start of the file.
+static constexpr std::size_t highlight_context = 1 << 12;
+// Edits restart the worker once they pause this long, each run pins
+// the collector, which gets to compact in between.
+static constexpr std::chrono::milliseconds highlight_restart_delay{250};
+
+bool Buffer::start_highlighting() {
+    RopeNode *root = snapshot();
+    std::size_t end = std::min<std::size_t>(_highlight_end, line_count());
+    std::size_t stale = _highlight.first_stale();
+    if (root == nullptr || _highlight_worker.running() || stale >= end)
+        return false;
+    if (std::chrono::steady_clock::now() - _last_edit < highlight_restart_delay)
+        return true;
+    _highlight_worker.start(root, stale, end, _highlight.state_before(stale));
+    return true;
+}
+
+bool Buffer::draw(Screen &screen, int x0, int y0, int x1, int y1) {
     if (!marked_for_update()) return false;
     int max_line = y1 - y0;
-    int cur_line = 0;
+    load_lines(_top + max_line);
+    RopeNode *root = snapshot();
+    std::size_t view_end = std::min(_top + max_line, line_count());
+    _highlight_end = std::min<std::size_t>(view_end + highlight_lookahead, line_count());
+    std::size_t top = _top;
+    if (top < _highlight.start() || top - _highlight.start() > 2 * highlight_context) {
+        _highlight_worker.cancel();
+        _highlight.rebase(top - std::min(top, highlight_context));
+    }
+    _highlight.set_window(_top, _top + max_line);
+    _highlight.forget(view_end + highlight_lookahead);
+
+    // Lines further down may need repainting if e.g. a comment was opened.
+    auto [first, last] = _highlight.update(
+        view_end,
+        [this](std::size_t row) { return line(row); },
+        root ? sync_highlight_lines : std::numeric_limits<std::size_t>::max());
+    if (first < last)
+        mark_lines(first, last);
+
+    start_highlighting();
 
-    clear(ClearOpt::Screen);
-    while (cur_line < _lines.size() && cur_line < max_line) {
-        set_cursor_position(y0 + cur_line, x0);
-        print_highlighted(_lines[cur_line]);
-        fflush(stdout);
-        // NOTE: Moves cursor AND flushes `line`:
-        cur_line++;
+    // Lines the worker hasn't got to yet are lexed on their own,
+    // guessing their state, and repainted once it has.
+    LexState guess = LexState::Normal;
+    std::vector<Token> provisional;
+    for (int screen_line = 0; screen_line < max_line; screen_line++) {
+        int cur_line = _top + screen_line;
+        if (cur_line >= line_count()) {
+            if (line_marked_for_update(cur_line))
+                screen.clear(y0 + screen_line, x0, x1);
+            continue;
+        }
+
+        if (_highlight.valid(cur_line)) {
+            guess = _highlight.end_state(cur_line);
+            if (!line_marked_for_update(cur_line)) continue;
+            std::string text = line(cur_line);
+            screen.clear(y0 + screen_line, x0, x1);
+            draw_highlighted(screen, y0 + screen_line, x0, x1, text,
+                             _highlight.tokens(cur_line, text));
+        } else {
+            if (!line_marked_for_update(cur_line)) continue;
+            std::string text = line(cur_line);
+            provisional.clear();
+            guess = lex_line(text, guess, provisional);
+            screen.clear(y0 + screen_line, x0, x1);
+            draw_highlighted(screen, y0 + screen_line, x0, x1, text, provisional);
+        }
     }
 
     mark_updated();
@@ -103,7 +183,7 @@ bool StringBuffer::draw(int x0, int y0, int x1, int y1) {
 
 int StringBuffer::max_col(int line) {
     //assert(_lines[line].size() - 1 <= std::numeric_limits<int>::max() || (printf("line = %d, max= %d\n", line, _lines.size()) && false));
-    return std::min((int)_lines[line].size(), active_frame()._cols - 1);
+    return byte_col(line, active_frame()._cols - 1);
 }
 
 int StringBuffer::min_col(int line) {
@@ -112,9 +192,364 @@ int StringBuffer::min_col(int line) {
 
 int StringBuffer::max_row() {
     //assert(_lines.size() - 1 <= std::numeric_limits<int>::max());
-    return std::min((int)_lines.size() - 1, active_frame()._rows - 1);
+    return std::max(0, (int)_lines.size() - 1);
 }
 
 int StringBuffer::min_row() {
     return 0;
 }
+
+
+bool StringBuffer::search(std::string_view needle, bool forward, bool skip) {
+    if (forward) {
+        std::size_t col = _col + skip;
+        for (int row = _row; row < (int)_lines.size(); row++, col = 0) {
+            std::string_view line = _lines[row];
+            if (col > line.size())
+                continue;
+            std::size_t at = find(line.substr(col), needle);
+            if (at != std::string_view::npos) {
+                _row = row;
+                _col = col + at;
+                return true;
+            }
+        }
+    } else {
+        // Look for matches starting before `end`.
+        std::size_t end = _col + !skip;
+        for (int row = _row; row >= 0; row--) {
+            std::string_view line = _lines[row];
+            if (row != _row)
+                end = line.size() + 1;
+            if (end == 0)
+                continue;
+            std::size_t at = rfind(line.substr(0, end - 1 + needle.size()), needle);
+            if (at != std::string_view::npos) {
+                _row = row;
+                _col = at;
+                return true;
+            }
+        }
+    }
+    return false;
+}
+
+std::vector<RegexMatch> StringBuffer::find_all(const Regex &regex) {
+    RegexMatcher matcher(regex);
+    std::vector<RegexMatch> matches;
+    for (std::size_t row = 0; row < _lines.size(); row++)
+        matcher.find_all(_lines[row], row, matches);
+    return matches;
+}
+
+void StringBuffer::save() {
+    static const char newline = '\n';
+    std::vector<iovec> data;
+    for (const std::string &line : _lines) {
+        data.push_back({const_cast<char *>(line.data()), line.size()});
+        data.push_back({const_cast<char *>(&newline), 1});
+    }
+    if (!_final_newline && !data.empty())
+        data.pop_back();
+    try {
+        active_frame().set_status(describe_save(_path, save_file(_path, data)));
+    } catch (const std::system_error &e) {
+        active_frame().set_status(std::string("Saving failed: ") + e.what());
+    }
+}
+
+
+void RopeBuffer::touch(std::size_t offset, std::size_t length) const {
+    std::size_t end = offset + length;
+    for (RopeCursor cursor(_root, offset); cursor.offset() < end && !cursor.at_end(); cursor.next_chunk()) {
+        std::string_view chunk = cursor.chunk();
+        _file.touch(chunk.data(), std::min(chunk.size(), end - cursor.offset()));
+    }
+}
+
+std::string RopeBuffer::line(int row) const {
+    std::size_t offset = line_offset(row), length = line_length(row);
+    touch(offset, length);
+    return _root->render(offset, length);
+}
+
+void RopeBuffer::index(std::size_t end) {
+    std::size_t start = _root->indexed_length();
+    if (start >= end)
+        return;
+    _root = _root->index(end);
+
+    std::size_t stop = _root->indexed_length();
+    touch(start, stop - start);
+    for (RopeCursor cursor(_root, start); cursor.offset() < stop && !cursor.at_end(); cursor.next_chunk())
+        _utf8.feed(cursor.chunk().substr(0, stop - cursor.offset()));
+}
+
+void RopeBuffer::load_lines(int count) {
+    while (!_root->indexed && _root->newlines < (std::size_t)count)
+        index(_root->indexed_length() + 1);
+}
+
+void RopeBuffer::load_offset(std::size_t offset) {
+    // Everything up to `offset` in one go, then the rest of its line.
+    index(offset + 1);
+    while (!_root->indexed && _root->line_of_offset(offset) >= _root->newlines)
+        load_lines(_root->newlines + 1);
+}
+
+int RopeBuffer::max_col(int line) {
+    return byte_col(line, active_frame()._cols - 1);
+}
+
+int RopeBuffer::min_col(int line) {
+    return 0;
+}
+
+int RopeBuffer::next_col(int row, int col) const {
+    std::size_t start = line_offset(row), offset = start + col;
+    std::size_t next = _root->offset_of_codepoint(_root->codepoint_of_offset(offset) + 1);
+    return std::min(next, start + line_length(row)) - start;
+}
+
+int RopeBuffer::prev_col(int row, int col) const {
+    std::size_t start = line_offset(row), offset = start + col;
+    std::size_t codepoint = _root->codepoint_of_offset(offset);
+    if (col == 0 || codepoint == 0)
+        return 0;
+    return std::max(_root->offset_of_codepoint(codepoint - 1), start) - start;
+}
+
+/**
+ * Walk the codepoints of [start, end) in `root` without copying them,
+ * calling `visit(offset, count, width)` for runs of `count` codepoints
+ * of `width` columns starting at `offset` (a run of ASCII, or a single
+ * codepoint) until it returns false. Sequences may span leaves.
+ */
+template<typename Visit>
+static void walk_columns(const RopeNode *root, std::size_t start, std::size_t end, Visit visit) {
+    // The pending multibyte sequence, past 4 bytes it's invalid anyway.
+    char sequence[5];
+    std::size_t length = 0, sequence_start = 0;
+    auto flush = [&] {
+        if (length == 0)
+            return true;
+        std::size_t at = 0;
+        int width = codepoint_width(decode_utf8(std::string_view(sequence, length), at));
+        length = 0;
+        return visit(sequence_start, 1, width);
+    };
+
+    for (RopeCursor cursor(root, start); cursor.offset() < end && !cursor.at_end(); cursor.next_chunk()) {
+        std::size_t base = cursor.offset();
+        std::string_view chunk = cursor.chunk().substr(0, end - base);
+        for (std::size_t i = 0; i < chunk.size();) {
+            if (!is_codepoint_start(chunk[i]) && base + i != start) {
+                // Continuing the pending sequence, or a stray byte
+                // belonging to an ASCII character.
+                if (length > 0 && length < sizeof(sequence))
+                    sequence[length++] = chunk[i];
+                i++;
+                continue;
+            }
+            if (!flush())
+                return;
+            std::size_t ascii = ascii_prefix(chunk.data() + i, chunk.size() - i);
+            if (ascii > 0) {
+                if (!visit(base + i, ascii, 1))
+                    return;
+                i += ascii;
+            } else {
+                sequence_start = base + i;
+                sequence[length++] = chunk[i++];
+            }
+        }
+    }
+    flush();
+}
+
+int RopeBuffer::display_col(int row, int col) const {
+    std::size_t start = line_offset(row);
+    if (single_bytes(start, col))
+        return col;
+
+    touch(start, col);
+    std::size_t display = 0;
+    walk_columns(_root, start, start + col, [&](std::size_t, std::size_t count, int width) {
+        display += count * width;
+        return true;
+    });
+    return display;
+}
+
+int RopeBuffer::byte_col(int row, int display) const {
+    std::size_t start = line_offset(row), length = line_length(row);
+    if (single_bytes(start, length))
+        return std::min<std::size_t>(display, length);
+
+    // Stop at the codepoint covering `display`, marks after it go with it.
+    std::size_t col = length, width = 0;
+    walk_columns(_root, start, start + length, [&](std::size_t offset, std::size_t count, int w) {
+        if (w > 0 && width + count * w > (std::size_t)display) {
+            col = offset + (display - width) / w - start;
+            return false;
+        }
+        width += count * w;
+        return true;
+    });
+    touch(start, col);
+    return col;
+}
+
+int RopeBuffer::max_row() {
+    return line_count() - 1;
+}
+
+int RopeBuffer::min_row() {
+    return 0;
+}
+
+/**
+ * Insert text at the cursor (without moving it). Text typed at the end
+ * of the previous insertion lands right after it in `_store`, so it
+ * grows the previous leaf instead of adding another one.
+ */
+void RopeBuffer::insert_text(const char *string, std::size_t length) {
+    std::size_t offset = cursor_offset();
+    refine(offset);
+    const char *tail = _store.tail();
+    const char *text = _store.append(string, length);
+
+    RopeNode *root = text == tail ? _root->extend(offset, text, length) : nullptr;
+    if (root == nullptr) {
+        root = _root->insert(text, length, offset);
+        root = root->coalesce(offset + length, _store);
+        root = root->coalesce(offset, _store);
+    }
+    _root = root;
+}
+
+void RopeBuffer::kill_text(std::size_t offset, std::size_t length) {
+    refine(offset);
+    _root = _root->kill(offset, length)->coalesce(offset, _store);
+}
+
+void RopeBuffer::insert(char c) {
+    insert_text(&c, 1);
+    _col++;
+    line_edited(_row);
+}
+
+void RopeBuffer::insert(std::string_view text) {
+    if (text.empty())
+        return;
+    insert_text(text.data(), text.size());
+
+    std::size_t lines = std::count(text.begin(), text.end(), '\n');
+    if (lines == 0) {
+        _col += text.size();
+        line_edited(_row);
+    } else {
+        lines_inserted(_row, lines);
+        _row += lines;
+        _col = text.size() - text.rfind('\n') - 1;
+    }
+}
+
+bool RopeBuffer::search(std::string_view needle, bool forward, bool skip) {
+    std::size_t offset = cursor_offset();
+    std::optional<std::size_t> match = forward
+        ? find(_root, needle, offset + skip)
+        : rfind(_root, needle, offset + !skip);
+    // Keep what the search read in check as well.
+    std::size_t reached = match ? *match : forward ? _root->length : 0;
+    touch(std::min(offset, reached), std::max(offset, reached) - std::min(offset, reached));
+    if (!match)
+        return false;
+
+    load_offset(*match);
+    _row = _root->line_of_offset(*match);
+    _col = *match - line_offset(_row);
+    return true;
+}
+
+std::vector<RegexMatch> RopeBuffer::find_all(const Regex &regex) {
+    // Line numbers need every newline counted, which is a full scan
+    // just like the search itself.
+    touch(0, _root->length);
+    index(_root->length);
+    return ::find_all(_root, regex);
+}
+
+void RopeBuffer::save() {
+    if (_save.running()) {
+        active_frame().set_status("Already saving " + _path);
+        return;
+    }
+    _save.start(_root, _path);
+    active_frame().set_status("Saving " + _path + "...");
+}
+
+bool RopeBuffer::poll_background() {
+    bool busy = Buffer::poll_background();
+    if (std::optional<std::string> report = _save.poll())
+        active_frame().set_status(*report);
+    return busy || _save.running();
+}
+
+bool RopeBuffer::draw(Screen &screen, int x0, int y0, int x1, int y1) {
+    // Cursor movement keeps scanning the leaf under the cursor, and
+    // edits most likely land there.
+    refine(cursor_offset());
+    return Buffer::draw(screen, x0, y0, x1, y1);
+}
+
+void RopeBuffer::new_line() {
+    insert_text("\n", 1);
+    line_split(_row);
+    _row++;
+    _col = 0;
+}
+
+void RopeBuffer::delete_backward() {
+    if (_col > 0) {
+        int col = prev_col(_row, _col);
+        kill_text(cursor_offset() - (_col - col), _col - col);
+        _col = col;
+        line_edited(_row);
+    } else if (_row > 0) {
+        _row--;
+        _col = line_length(_row);
+        kill_text(cursor_offset(), 1);
+        lines_joined(_row);
+        // Stays within the frame, as StringBuffer's `end_of_line()` does.
+        clamp_cursor();
+    } else {
+        // NOTE: Beginning of file.
+    }
+}
+
+void RopeBuffer::delete_forward() {
+    // Joining the last line loaded with the next one needs it loaded.
+    load_lines(_row + 2);
+    std::size_t offset = cursor_offset();
+    if (offset < _root->length) {
+        std::size_t length = 1;
+        if (_col < line_length(_row)) {
+            length = next_col(_row, _col) - _col;
+            line_edited(_row);
+        } else {
+            lines_joined(_row);
+        }
+        kill_text(offset, length);
+    } else {
+        // NOTE: End of file.
+    }
+}
+
+void RopeBuffer::kill_line() {
+    std::size_t length = line_length(_row);
+    if (_col < length) {
+        kill_text(cursor_offset(), length - _col);
+        line_edited(_row);
+    }
+}
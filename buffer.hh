@@ -1,27 +1,141 @@
 #pragma once
 
 #include <algorithm>
+#include <chrono>
+#include <limits>
 #include <string>
+#include <string_view>
 #include <sstream>
 #include <vector>
 #include <cassert>
 
 #include "term.hh"
+#include "screen.hh"
+#include "rope.hh"
+#include "gc.hh"
+#include "file.hh"
+#include "store.hh"
+#include "highlight.hh"
+#include "regex.hh"
+#include "save.hh"
+#include "utf8.hh"
 
 class Buffer {
 public:
+    // `_col` is a byte offset into the line, at the start of a codepoint.
     int _col = 0, _row = 0;
+    // First line shown, the viewport spans the frame's height from here.
+    int _top = 0;
+    // File the buffer is saved to.
+    std::string _path;
+
+    virtual ~Buffer() = default;
 private:
-    bool _update = true;
+    // Damaged lines as disjoint, half open [first, last) intervals.
+    std::vector<std::pair<int, int>> _damage{{0, std::numeric_limits<int>::max()}};
+public:
+    // Mark every line for redraw.
+    void mark_for_update() { mark_lines(0, std::numeric_limits<int>::max()); }
+    // Mark lines [first, last) for redraw.
+    void mark_lines(int first, int last);
+    void mark_line(int row) { mark_lines(row, row + 1); }
+    // Mark `row` and every line after it, for edits shifting lines.
+    void mark_from(int row) { mark_lines(row, std::numeric_limits<int>::max()); }
+
+    bool marked_for_update() { return !_damage.empty(); }
+    bool line_marked_for_update(int row) {
+        return std::any_of(_damage.begin(), _damage.end(), [row](auto& d) {
+            return d.first <= row && row < d.second;
+        });
+    }
+    void mark_updated() { assert(!_damage.empty()); _damage.clear(); }
+
+protected:
+    HighlightCache _highlight;
+    HighlightWorker _highlight_worker;
+    // Lines the worker lexes up to, set on draw.
+    std::size_t _highlight_end = 0;
+    std::chrono::steady_clock::time_point _last_edit;
+
+    /**
+     * Leave the stale lines before `_highlight_end` to the worker, unless
+     * the text was just edited. Returns true while that is pending.
+     */
+    bool start_highlighting();
+
+    // Checks the text as it is loaded, reported once if it is invalid.
+    Utf8Validator _utf8;
+    bool _utf8_reported = false;
+
+    // Bookkeeping after edits, damages the affected lines and drops
+    // their highlighting.
+    void line_edited(int row) {
+        _last_edit = std::chrono::steady_clock::now();
+        mark_line(row);
+        _highlight.edit_line(row);
+        _highlight_worker.edited(row, row + 1, 0);
+    }
+    // Line `row` was split into `count + 1` lines.
+    void lines_inserted(int row, int count) {
+        _last_edit = std::chrono::steady_clock::now();
+        mark_from(row);
+        _highlight.edit_line(row);
+        _highlight.insert_lines(row + 1, count);
+        _highlight_worker.edited(row, row + 1, count);
+    }
+    void line_split(int row) { lines_inserted(row, 1); }
+    void lines_joined(int row) {
+        _last_edit = std::chrono::steady_clock::now();
+        mark_from(row);
+        _highlight.remove_lines(row + 1, 1);
+        _highlight.edit_line(row);
+        _highlight_worker.edited(row, row + 2, -1);
+    }
 public:
-    void mark_for_update() { _update = true; }
-    bool marked_for_update() { return _update; }
-    void mark_updated() { assert(_update); _update = false; }
+    virtual int line_count() const = 0;
+    virtual std::string line(int row) const = 0;
+
+    /**
+     * Make (at least) the first `count` lines available, for buffers
+     * that only read their file as far as it has been looked at.
+     */
+    virtual void load_lines(int count) { }
+
+    /**
+     * Byte column of the codepoint after (or before) the one at `col`,
+     * staying on the line.
+     */
+    virtual int next_col(int row, int col) const = 0;
+    virtual int prev_col(int row, int col) const = 0;
+
+    /**
+     * Terminal column byte column `col` is shown at, and the byte
+     * column shown at (or straddling) terminal column `display`. Only
+     * read the line as far as the column.
+     */
+    virtual int display_col(int row, int col) const = 0;
+    virtual int byte_col(int row, int display) const = 0;
 
     /**
-     * Draw buffer, returns true if the buffer was redrawn.
+     * Immutable snapshot of the contents, or null if the buffer can't
+     * provide one. Highlighting is done in the background if it can.
      */
-    virtual bool draw(int x0, int y0, int x1, int y1) = 0;
+    virtual RopeNode *snapshot() const { return nullptr; }
+
+    // Note text of the snapshot that was read in the background.
+    virtual void read_in_background(std::string_view text) const { }
+
+    /**
+     * Pick up work done in the background, e.g. damaging the lines
+     * highlighting changed. Returns true while some is still going on.
+     */
+    virtual bool poll_background();
+
+    /**
+     * Draw buffer into the given region of `screen`, returns true if
+     * the buffer was redrawn.
+     */
+    virtual bool draw(Screen &screen, int x0, int y0, int x1, int y1);
 
     virtual int max_col(int row) = 0;
     virtual int min_col(int row) = 0;
@@ -29,37 +143,75 @@ public:
     virtual int min_row() = 0;
 
     void clamp_cursor() {
+        load_lines(_row + 1);
         _row = std::min(max_row(), std::max(min_row(), _row));
         _col = std::min(max_col(_row), std::max(min_col(_row), _col));
     }
 
+    // Moves to `row`, keeping the cursor in the same terminal column.
+    void move_to_row(int row);
     void cursor_up();
     void cursor_down();
     void cursor_left();
     void cursor_right();
 
+    void page_up();
+    void page_down();
+
+    /**
+     * Scroll the viewport just enough for the cursor to be visible.
+     */
+    void scroll_to_cursor();
+
     virtual void insert(char c) { }
+    // Insert text (e.g. a paste) in one go, leaving the cursor after it.
+    virtual void insert(std::string_view text) { }
     virtual void beginning_of_line() { }
     virtual void end_of_line() { }
     virtual void new_line() { }
     virtual void delete_backward() { }
     virtual void delete_forward() { }
     virtual void kill_line() { }
+
+    /**
+     * Move the cursor to the next match of `needle` at or after the
+     * cursor (or at or before it, if not `forward`), passing over one
+     * right at the cursor if `skip`. Returns false and leaves the
+     * cursor be if there is none.
+     */
+    virtual bool search(std::string_view needle, bool forward, bool skip) { return false; }
+
+    // Every match of `regex`, in order.
+    virtual std::vector<RegexMatch> find_all(const Regex &regex) { return {}; }
+
+    // Write the buffer to `_path`, reporting on the status line.
+    virtual void save() { }
 };
 
 
 class StringBuffer : public Buffer {
 public:
     std::vector<std::string> _lines;
+    // Whether the text ended in a newline, kept that way when saving.
+    bool _final_newline;
 
-    StringBuffer(std::string s) {
+    StringBuffer(std::string s) : _final_newline(s.empty() || s.back() == '\n') {
+        _utf8.feed(s);
         std::istringstream iss{s};
         std::string line;
         while (std::getline(iss, line))
             _lines.push_back(line);
     }
 
-    bool draw(int x0, int y0, int x1, int y1) override;
+    int line_count() const override { return _lines.size(); }
+    std::string line(int row) const override { return _lines[row]; }
+
+    int next_col(int row, int col) const override { return next_codepoint(_lines[row], col); }
+    int prev_col(int row, int col) const override { return prev_codepoint(_lines[row], col); }
+    int display_col(int row, int col) const override {
+        return display_width(std::string_view(_lines[row]).substr(0, col));
+    }
+    int byte_col(int row, int display) const override { return offset_of_column(_lines[row], display); }
 
     int max_col(int line) override;
     int min_col(int line) override;
@@ -79,7 +231,34 @@ public:
     void insert(char c) override {
         current_line().insert(_col, 1, c);
         _col++;
-        mark_for_update();
+        line_edited(_row);
+    }
+
+    void insert(std::string_view text) override {
+        std::vector<std::string> added;
+        std::size_t newline;
+        while ((newline = text.find('\n')) != std::string_view::npos) {
+            added.emplace_back(text.substr(0, newline));
+            text.remove_prefix(newline + 1);
+        }
+
+        std::string rest = current_line().substr(_col);
+        current_line().erase(_col);
+        if (added.empty()) {
+            current_line().append(text);
+            _col = current_line().size();
+            current_line().append(rest);
+            line_edited(_row);
+            return;
+        }
+
+        current_line().append(added.front());
+        added.front() = std::string(text) + rest;
+        std::rotate(added.begin(), added.begin() + 1, added.end());
+        _lines.insert(_lines.begin() + _row + 1, added.begin(), added.end());
+        lines_inserted(_row, added.size());
+        _row += added.size();
+        _col = text.size();
     }
 
     void beginning_of_line() override {
@@ -95,23 +274,24 @@ public:
         std::string curr = current_line().substr(_col);
         current_line() = curr;
         _lines.insert(_lines.begin() + _row, next);
+        line_split(_row);
         _row++;
         _col = 0;
-        mark_for_update();
     }
 
     void delete_backward() override {
         if (_col > 0) {
-            current_line().erase(_col - 1, 1);
-            _col--;
-            mark_for_update();
+            int col = prev_col(_row, _col);
+            current_line().erase(col, _col - col);
+            _col = col;
+            line_edited(_row);
         } else if (_row > 0) {
             _row--;
             end_of_line();
 
             current_line() = current_line() + next_line();
             _lines.erase(_lines.begin() + _row + 1);
-            mark_for_update();
+            lines_joined(_row);
         } else {
             // NOTE: Beginning of file.
         }
@@ -120,12 +300,12 @@ public:
     void delete_forward() override {
         std::string& line = current_line();
         if (_col < line.size()) {
-            line.erase(_col, 1);
-            mark_for_update();
-        } else if (_row < _lines.size()) {
+            line.erase(_col, next_col(_row, _col) - _col);
+            line_edited(_row);
+        } else if (_row + 1 < _lines.size()) {
             current_line() = current_line() + next_line();
             _lines.erase(_lines.begin() + _row + 1);
-            mark_for_update();
+            lines_joined(_row);
         } else {
             // NOTE: End of file.
         }
@@ -134,7 +314,120 @@ public:
     void kill_line() override {
         if (current_line().size() > 0) {
             current_line() = current_line().substr(0, _col);
-            mark_for_update();
+            line_edited(_row);
         }
     }
+
+    bool search(std::string_view needle, bool forward, bool skip) override;
+    std::vector<RegexMatch> find_all(const Regex &regex) override;
+    void save() override;
+};
+
+
+class RopeBuffer : public Buffer {
+    // Backing storage of the leaves, must outlive `_root`:
+    std::string _text;
+    MappedFile _file;
+    TextStore _store;
+
+    // Reads the leaves, so goes before them.
+    BackgroundSave _save;
+
+    void insert_text(const char *string, std::size_t length);
+    // Cut the leaf under `offset` down to `max_leaf` before working in it.
+    void refine(std::size_t offset) { _root = _root->refine(offset); }
+    // Note reads of the mapping, see `MappedFile::touch()`.
+    void touch(std::size_t offset, std::size_t length) const;
+    void kill_text(std::size_t offset, std::size_t length);
+    // Index the leaves starting before `end`, validating their text.
+    void index(std::size_t end);
+    // Whether [offset, offset + length) is a byte per codepoint.
+    bool single_bytes(std::size_t offset, std::size_t length) const {
+        return _root->codepoint_of_offset(offset + length) - _root->codepoint_of_offset(offset) == length;
+    }
+public:
+    RopeNode *_root;
+
+    RopeBuffer(std::string s) : _text{std::move(s)} {
+        _utf8.feed(_text);
+        _root = make_rope(_text.data(), _text.size());
+        rope_collector().add_root(&_root);
+    }
+
+    /**
+     * Edit a mapped file in place, leaves point directly into the mapping.
+     * The file is only read (and split into lines) as far as it is
+     * looked at, see `load_lines()`.
+     */
+    RopeBuffer(MappedFile file) : _file{std::move(file)} {
+        _root = make_lazy_rope(_file.data(), _file.size());
+        rope_collector().add_root(&_root);
+        load_lines(1);
+    }
+
+    RopeBuffer(const RopeBuffer&) = delete;
+    RopeBuffer& operator=(const RopeBuffer&) = delete;
+
+    ~RopeBuffer() {
+        // The worker reads the leaves, which are gone before `Buffer` is.
+        _highlight_worker.cancel();
+        rope_collector().remove_root(&_root);
+    }
+
+    int max_col(int line) override;
+    int min_col(int line) override;
+    int max_row() override;
+    int min_row() override;
+
+    // Past the indexed leaves only the lines ended within them are known.
+    int line_count() const override {
+        return _root->indexed ? _root->line_count() : _root->newlines;
+    }
+    void load_lines(int count) override;
+    // Index the leaves up to the end of the line containing `offset`.
+    void load_offset(std::size_t offset);
+    std::size_t line_offset(int row) const { return _root->offset_of_line(row); }
+    std::size_t line_length(int row) const { return _root->line_length(row); }
+    std::string line(int row) const override;
+    RopeNode *snapshot() const override { return _root; }
+    void read_in_background(std::string_view text) const override {
+        _file.touch(text.data(), text.size());
+    }
+
+    // Codepoint counts in the rope keep these O(log n) for ASCII lines,
+    // other lines are streamed up to the column.
+    int next_col(int row, int col) const override;
+    int prev_col(int row, int col) const override;
+    int display_col(int row, int col) const override;
+    int byte_col(int row, int display) const override;
+
+    /**
+     * Byte offset of the cursor into `_root`.
+     */
+    std::size_t cursor_offset() const { return line_offset(_row) + _col; }
+
+    void insert(char c) override;
+    void insert(std::string_view text) override;
+
+    void beginning_of_line() override {
+        _col = min_col(_row);
+    }
+
+    void end_of_line() override {
+        _col = max_col(_row);
+    }
+
+    void new_line() override;
+    void delete_backward() override;
+    void delete_forward() override;
+    void kill_line() override;
+    bool search(std::string_view needle, bool forward, bool skip) override;
+    std::vector<RegexMatch> find_all(const Regex &regex) override;
+
+    /**
+     * Save in the background, from a snapshot.
+     */
+    void save() override;
+    bool poll_background() override;
+    bool draw(Screen &screen, int x0, int y0, int x1, int y1) override;
 };
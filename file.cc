@@ -0,0 +1,153 @@
+#include "file.hh"
+
+#include <algorithm>
+#include <cerrno>
+#include <chrono>
+#include <climits>
+#include <system_error>
+#include <utility>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+MappedFile::MappedFile(const std::string &path) : _data{nullptr}, _size{0} {
+    int fd = ::open(path.c_str(), O_RDONLY);
+    if (fd == -1)
+        throw std::system_error(errno, std::generic_category(), path);
+
+    struct stat st;
+    if (fstat(fd, &st) == -1) {
+        int error = errno;
+        close(fd);
+        throw std::system_error(error, std::generic_category(), path);
+    }
+
+    // NOTE: mmap() refuses empty mappings, leave those unmapped.
+    if (st.st_size > 0) {
+        void *data = mmap(nullptr, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (data == MAP_FAILED) {
+            int error = errno;
+            close(fd);
+            throw std::system_error(error, std::generic_category(), path);
+        }
+        _data = static_cast<const char *>(data);
+        _size = st.st_size;
+    }
+
+    // The mapping keeps its own reference to the file.
+    close(fd);
+}
+
+MappedFile &MappedFile::operator=(MappedFile &&other) noexcept {
+    std::swap(_data, other._data);
+    std::swap(_size, other._size);
+    std::swap(_recent, other._recent);
+    std::swap(_resident, other._resident);
+    return *this;
+}
+
+void MappedFile::touch(const char *p, std::size_t length) const {
+    if (_data == nullptr || p < _data || p >= _data + _size || length == 0)
+        return;
+
+    std::size_t first = (p - _data) / extent;
+    std::size_t last = std::min<std::size_t>(p - _data + length - 1, _size - 1) / extent;
+    for (std::size_t i = first; i <= last; i++) {
+        auto it = _resident.find(i);
+        if (it != _resident.end()) {
+            _recent.splice(_recent.begin(), _recent, it->second);
+        } else {
+            _recent.push_front(i);
+            _resident.emplace(i, _recent.begin());
+        }
+    }
+
+    std::size_t limit = std::max<std::size_t>(1, resident_limit / extent);
+    while (_recent.size() > limit) {
+        std::size_t i = _recent.back();
+        std::size_t start = i * extent;
+        madvise(const_cast<char *>(_data) + start, std::min(extent, _size - start), MADV_DONTNEED);
+        _resident.erase(i);
+        _recent.pop_back();
+    }
+}
+
+MappedFile::~MappedFile() {
+    if (_data != nullptr)
+        munmap(const_cast<char *>(_data), _size);
+}
+
+/**
+ * Write all of `data`, at most IOV_MAX slices per call.
+ */
+static void write_all(int fd, std::vector<iovec> data, const std::string &path) {
+    std::size_t first = 0;
+    while (first < data.size()) {
+        int count = std::min<std::size_t>(data.size() - first, IOV_MAX);
+        ssize_t n = writev(fd, &data[first], count);
+        if (n == -1 && errno == EINTR)
+            continue;
+        if (n == -1)
+            throw std::system_error(errno, std::generic_category(), path);
+
+        // Skip what was written, finishing off a partially written slice.
+        while (first < data.size() && (std::size_t)n >= data[first].iov_len)
+            n -= data[first++].iov_len;
+        if (n > 0) {
+            data[first].iov_base = static_cast<char *>(data[first].iov_base) + n;
+            data[first].iov_len -= n;
+        }
+    }
+}
+
+SaveStats save_file(const std::string &path, const std::vector<iovec> &data) {
+    using clock = std::chrono::steady_clock;
+    auto start = clock::now();
+
+    std::string temporary = path + ".XXXXXX";
+    int fd = mkstemp(temporary.data());
+    if (fd == -1)
+        throw std::system_error(errno, std::generic_category(), temporary);
+
+    SaveStats stats{0, 0, 0};
+    try {
+        // Keep the permissions of the file being replaced.
+        struct stat st;
+        mode_t mode = ::stat(path.c_str(), &st) == 0 ? st.st_mode & 07777 : 0644;
+        if (fchmod(fd, mode) == -1)
+            throw std::system_error(errno, std::generic_category(), temporary);
+
+        write_all(fd, data, temporary);
+        for (const iovec &slice : data)
+            stats.bytes += slice.iov_len;
+        stats.write_seconds = std::chrono::duration<double>(clock::now() - start).count();
+
+        if (fsync(fd) == -1)
+            throw std::system_error(errno, std::generic_category(), temporary);
+        if (close(fd) == -1) {
+            fd = -1;
+            throw std::system_error(errno, std::generic_category(), temporary);
+        }
+        fd = -1;
+        if (rename(temporary.c_str(), path.c_str()) == -1)
+            throw std::system_error(errno, std::generic_category(), path);
+    } catch (...) {
+        if (fd != -1)
+            close(fd);
+        unlink(temporary.c_str());
+        throw;
+    }
+
+    // Make the rename itself durable.
+    std::size_t slash = path.rfind('/');
+    std::string directory = slash == std::string::npos ? "." : path.substr(0, slash + 1);
+    int dir = ::open(directory.c_str(), O_RDONLY | O_DIRECTORY);
+    if (dir != -1) {
+        fsync(dir);
+        close(dir);
+    }
+
+    stats.durable_seconds = std::chrono::duration<double>(clock::now() - start).count();
+    return stats;
+}
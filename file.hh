@@ -0,0 +1,77 @@
+#pragma once
+
+#include <cstddef>
+#include <list>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <vector>
+#include <sys/uio.h>
+
+/**
+ * Read-only memory mapping of an entire file. Pages are faulted in
+ * from the page cache on access, so mapping is near-instant regardless
+ * of file size.
+ */
+class MappedFile {
+    const char *_data;
+    std::size_t _size;
+
+    // Extents (by index) touched, most recently touched first, and
+    // where in `_recent` each of them is.
+    mutable std::list<std::size_t> _recent;
+    mutable std::unordered_map<std::size_t, std::list<std::size_t>::iterator> _resident;
+public:
+    // Unit and bound of the memory kept resident by `touch()`.
+    static constexpr std::size_t extent = 1 << 20;
+    static inline std::size_t resident_limit = std::size_t(256) << 20;
+
+    /**
+     * Map the file at `path`, throws `std::system_error` on failure.
+     */
+    MappedFile(const std::string &path);
+    MappedFile() : _data{nullptr}, _size{0} {}
+
+    MappedFile(MappedFile &&other) noexcept
+        : _data{other._data}, _size{other._size},
+          _recent{std::move(other._recent)}, _resident{std::move(other._resident)} {
+        other._data = nullptr;
+        other._size = 0;
+    }
+    MappedFile &operator=(MappedFile &&other) noexcept;
+
+    MappedFile(const MappedFile &) = delete;
+    MappedFile &operator=(const MappedFile &) = delete;
+
+    ~MappedFile();
+
+    // NOTE: Not null terminated.
+    const char *data() const { return _size > 0 ? _data : ""; }
+    std::size_t size() const { return _size; }
+    std::string_view view() const { return {data(), _size}; }
+
+    /**
+     * Note that [p, p + length) is being read, ignoring memory outside
+     * the mapping. Once more than `resident_limit` bytes have been
+     * touched, the least recently touched extents are dropped with
+     * madvise(MADV_DONTNEED), they are read back in from the file on
+     * the next access.
+     */
+    void touch(const char *p, std::size_t length) const;
+};
+
+struct SaveStats {
+    std::size_t bytes;
+    // Until everything was handed to the kernel, and until it was on disk.
+    double write_seconds;
+    double durable_seconds;
+};
+
+/**
+ * Replace the file at `path` with `data` without ever leaving it half
+ * written: the data goes to a temporary file next to it with writev(),
+ * which is fsync()ed and renamed over `path`, then the directory is
+ * fsync()ed. Throws `std::system_error` on failure, leaving `path`
+ * untouched.
+ */
+SaveStats save_file(const std::string &path, const std::vector<iovec> &data);
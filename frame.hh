@@ -2,9 +2,11 @@
 
 #include <vector>
 #include <memory>
+#include <string>
 
 #include "buffer.hh"
 #include "term.hh"
+#include "screen.hh"
 
 class Buffer;
 class Frame;
@@ -17,26 +19,74 @@ public:
     int _cols;
 
     std::vector<std::unique_ptr<Buffer>> buffers;
+    Screen screen;
+
+    // Message or prompt on the bottom line.
+    std::string _status;
+    bool _status_changed = true;
+
+    // Lines available to buffers, above the status line.
+    int text_rows() const { return std::max(1, _rows - 1); }
+
+    void set_status(std::string status) {
+        if (status != _status) {
+            _status = std::move(status);
+            _status_changed = true;
+        }
+    }
 
     Buffer& active_buffer() {
         return *buffers[0];
     }
 
     void mark_for_update() {
+        _status_changed = true;
         for (auto &buffer : buffers) {
             buffer->mark_for_update();
         }
     }
 
+    /**
+     * Pick up work the buffers had done in the background, returns
+     * true while some of it is still going on.
+     */
+    bool poll() {
+        bool busy = false;
+        for (auto &buffer : buffers) {
+            if (buffer->poll_background())
+                busy = true;
+        }
+        return busy;
+    }
+
     bool is_marked_for_update() {
-        return std::any_of(buffers.begin(), buffers.end(), [](auto& b){
+        return _status_changed || std::any_of(buffers.begin(), buffers.end(), [](auto& b){
             return b->marked_for_update();
         });
     }
 
+    /**
+     * Draw all buffers marked for update and emit whatever changed on
+     * screen since the last frame.
+     */
+    void render() {
+        for (auto &b : buffers) {
+            b->draw(screen, 0, 0, _cols, text_rows());
+        }
+        if (_status_changed) {
+            screen.clear(_rows - 1, 0, _cols);
+            screen.put(_rows - 1, 0, _status, Face::Default, _cols);
+            _status_changed = false;
+        }
+        if (screen.present()) {
+            restore_cursor_position();
+            show_cursor(true);
+        }
+    }
+
     void restore_cursor_position() {
         Buffer& buffer = active_buffer();
-        set_cursor_position(buffer._row, buffer._col);
+        set_cursor_position(buffer._row - buffer._top, buffer.display_col(buffer._row, buffer._col));
     }
 
     void update_size() {
@@ -45,7 +95,7 @@ public:
         bool size_changed = _cols != cols || _rows != rows;
         _cols = cols; _rows = rows;
         if (size_changed) {
-            //clear(ClearOpt::Screen);
+            screen.resize(rows, cols);
             restore_cursor_position();
             mark_for_update();
         }
@@ -54,6 +104,7 @@ public:
     void init() {
         update_size();
         enable_raw_mode();
+        bracketed_paste(true);
     }
 
 
@@ -0,0 +1,77 @@
+#pragma once
+
+#include <algorithm>
+#include <cassert>
+#include <vector>
+
+/**
+ * Sequence with a gap where it was last inserted into or removed
+ * from. Edits move the gap to them first, so a run of edits near each
+ * other costs O(distance between them) rather than O(size) each.
+ * Appending never moves the gap.
+ */
+template<typename T>
+class GapBuffer {
+    // Elements [0, gap), the gap, then the rest up to the end of `items`.
+    std::vector<T> items;
+    std::size_t gap = 0;
+    std::size_t gap_length = 0;
+
+    std::size_t slot(std::size_t i) const { return i < gap ? i : i + gap_length; }
+
+    void move_gap(std::size_t at) {
+        // An empty gap would move elements onto themselves.
+        if (gap_length == 0) {
+            gap = at;
+            return;
+        }
+        if (at < gap)
+            std::move_backward(items.begin() + at, items.begin() + gap, items.begin() + gap + gap_length);
+        else if (at > gap)
+            std::move(items.begin() + gap + gap_length, items.begin() + at + gap_length, items.begin() + gap);
+        gap = at;
+    }
+
+    // Widen the gap to at least `length`, geometrically.
+    void reserve_gap(std::size_t length) {
+        if (gap_length >= length)
+            return;
+        std::size_t grow = std::max(length - gap_length, items.size() / 2 + 16);
+        items.insert(items.begin() + gap + gap_length, grow, T{});
+        gap_length += grow;
+    }
+public:
+    std::size_t size() const { return items.size() - gap_length; }
+
+    T &operator[](std::size_t i) { return items[slot(i)]; }
+    const T &operator[](std::size_t i) const { return items[slot(i)]; }
+
+    // Insert `count` copies of `value` before element `at`.
+    void insert(std::size_t at, std::size_t count, const T &value = T{}) {
+        assert(at <= size());
+        move_gap(at);
+        reserve_gap(count);
+        std::fill(items.begin() + gap, items.begin() + gap + count, value);
+        gap += count;
+        gap_length -= count;
+    }
+
+    // Remove elements [at, at + count).
+    void erase(std::size_t at, std::size_t count) {
+        assert(at + count <= size());
+        move_gap(at);
+        // Let go of whatever the elements hold.
+        std::fill(items.begin() + gap + gap_length, items.begin() + gap + gap_length + count, T{});
+        gap_length += count;
+    }
+
+    // Grow (at the end, leaving the gap be) or shrink to `n` elements.
+    void resize(std::size_t n) {
+        if (n >= size())
+            items.resize(items.size() + n - size());
+        else
+            erase(n, size() - n);
+    }
+
+    void push_back(T value) { items.push_back(std::move(value)); }
+};
@@ -0,0 +1,107 @@
+#include "gc.hh"
+
+#include <algorithm>
+#include <cassert>
+#include <limits>
+
+RopeCollector &rope_collector() {
+    static RopeCollector collector;
+    return collector;
+}
+
+void RopeCollector::add_root(RopeNode **root) {
+    roots.push_back(root);
+}
+
+void RopeCollector::remove_root(RopeNode **root) {
+    roots.erase(std::find(roots.begin(), roots.end(), root));
+}
+
+void RopeCollector::mark(RopeNode *node) {
+    std::size_t index = arena().index_of(node);
+    if (index >= marked.size())
+        marked.resize(arena().used());
+    if (!marked[index]) {
+        marked[index] = true;
+        worklist.push_back(node);
+    }
+}
+
+std::size_t RopeCollector::drain(std::size_t budget) {
+    std::size_t work = 0;
+    while (!worklist.empty() && work < budget) {
+        RopeNode *node = worklist.back();
+        worklist.pop_back();
+        if (node->is_parent()) {
+            mark(node->left);
+            mark(node->right);
+        }
+        work++;
+    }
+    return work;
+}
+
+bool RopeCollector::step(std::size_t budget) {
+    if (!marking) {
+        marking = true;
+        marked.assign(arena().used(), false);
+        for (RopeNode **root : roots)
+            mark(*root);
+    }
+
+    drain(budget);
+    if (!worklist.empty() || pinned > 0)
+        return false;
+
+    // Pick up whatever the roots gained since the cycle started, every
+    // marked node already has its entire subtree marked.
+    for (RopeNode **root : roots)
+        mark(*root);
+    drain(std::numeric_limits<std::size_t>::max());
+
+    compact();
+    marking = false;
+    return true;
+}
+
+void RopeCollector::collect() {
+    assert(pinned == 0);
+    while (!step(std::numeric_limits<std::size_t>::max()));
+}
+
+void RopeCollector::compact() {
+    Arena<RopeNode> &arena = this->arena();
+    std::size_t used = arena.used();
+    marked.resize(used);
+
+    // Slide every live node down to the first free slot, in slot order,
+    // so a node is never moved on top of one that is yet to be moved.
+    std::vector<std::size_t> forward(used);
+    std::size_t live = 0;
+    for (std::size_t i = 0; i < used; i++) {
+        if (marked[i])
+            forward[i] = live++;
+    }
+
+    auto relocate = [&](RopeNode *node) {
+        return arena.slot(forward[arena.index_of(node)]);
+    };
+
+    for (std::size_t i = 0; i < used; i++) {
+        if (!marked[i])
+            continue;
+        RopeNode *node = arena.slot(i);
+        if (node->is_parent()) {
+            node->left = relocate(node->left);
+            node->right = relocate(node->right);
+        }
+        if (forward[i] != i)
+            *arena.slot(forward[i]) = *node;
+    }
+    for (RopeNode **root : roots)
+        *root = relocate(*root);
+
+    arena.truncate(live);
+    threshold = std::max(min_threshold, 2 * live);
+    marked.clear();
+}
@@ -0,0 +1,81 @@
+#pragma once
+
+#include <vector>
+
+#include "rope.hh"
+#include "arena.hh"
+
+class RopeCollector;
+
+RopeCollector &rope_collector();
+
+/**
+ * Mark-compact collector for the nodes in `Arena<RopeNode>::current`.
+ *
+ * Ropes are persistent, so every edit leaves the replaced path behind
+ * as garbage. The collector marks everything reachable from the
+ * registered roots and slides the survivors down to the start of the
+ * arena, rewriting child pointers and roots as it goes.
+ *
+ * Marking is incremental (see `step()`). Nodes are immutable once
+ * built, so a node reachable from the roots later in the cycle is
+ * either already marked or allocated after the cycle started; the
+ * final step re-marks from the current roots to pick those up before
+ * compacting.
+ */
+class RopeCollector {
+    std::vector<RopeNode **> roots;
+
+    std::vector<bool> marked;
+    std::vector<RopeNode *> worklist;
+    bool marking = false;
+    // Compaction is held off while non-zero.
+    int pinned = 0;
+
+    // Don't bother collecting arenas smaller than this.
+    std::size_t min_threshold = 1 << 16;
+    std::size_t threshold = min_threshold;
+
+    Arena<RopeNode> &arena() { return *Arena<RopeNode>::current; }
+
+    void mark(RopeNode *node);
+    std::size_t drain(std::size_t budget);
+    void compact();
+public:
+    /**
+     * Register a location holding a rope (e.g. the document or a
+     * snapshot), it is kept alive and updated when nodes move.
+     */
+    void add_root(RopeNode **root);
+    void remove_root(RopeNode **root);
+
+    bool in_progress() const { return marking; }
+
+    /**
+     * Hold off compaction, e.g. while another thread reads a snapshot.
+     * Marking carries on, a cycle completes on the first step after
+     * the last `unpin()`.
+     */
+    void pin() { pinned++; }
+    void unpin() { pinned--; }
+    // Whether compaction is held off, a cycle can't complete until unpinned.
+    bool is_pinned() const { return pinned > 0; }
+
+    /**
+     * True if the arena has grown enough since the last collection
+     * to warrant a new one.
+     */
+    bool should_collect() { return arena().size() >= threshold; }
+
+    /**
+     * Mark up to `budget` nodes, starting a cycle if none is in
+     * progress. Compacts (in one pause, O(allocated nodes)) once the
+     * marking is done. Returns true when a cycle completed.
+     */
+    bool step(std::size_t budget);
+
+    /**
+     * Run an entire collection cycle.
+     */
+    void collect();
+};
@@ -0,0 +1,363 @@
+#include "highlight.hh"
+
+#include <algorithm>
+#include <cassert>
+#include <cstring>
+#include <memory>
+
+#include "gc.hh"
+
+void LineSet::move_split(std::size_t to) {
+    while (!before.empty() && *before.rbegin() >= to) {
+        after.insert((std::ptrdiff_t)*before.rbegin() - offset);
+        before.erase(std::prev(before.end()));
+    }
+    while (!after.empty() && *after.begin() + offset < (std::ptrdiff_t)to) {
+        before.insert(*after.begin() + offset);
+        after.erase(after.begin());
+    }
+    split = to;
+}
+
+void LineSet::erase(std::size_t first, std::size_t last) {
+    before.erase(before.lower_bound(first), before.lower_bound(last));
+    after.erase(after.lower_bound((std::ptrdiff_t)first - offset),
+                after.lower_bound((std::ptrdiff_t)last - offset));
+}
+
+std::size_t LineSet::lower_bound(std::size_t line) const {
+    if (line < split) {
+        auto it = before.lower_bound(line);
+        if (it != before.end())
+            return *it;
+        line = split;
+    }
+    auto it = after.lower_bound((std::ptrdiff_t)line - offset);
+    return it == after.end() ? npos : *it + offset;
+}
+
+void LineSet::shift(std::size_t from, std::ptrdiff_t delta) {
+    move_split(from);
+    if (delta < 0) {
+        before.erase(before.lower_bound(from + delta), before.end());
+        split = from + delta;
+    }
+    offset += delta;
+}
+
+std::vector<Token> &HighlightCache::lex_into(std::size_t line) {
+    if (line < window_first || line - window_first >= window.size()) {
+        scratch.clear();
+        return scratch;
+    }
+    std::optional<std::vector<Token>> &tokens = window[line - window_first];
+    if (tokens)
+        tokens->clear();
+    else
+        tokens.emplace();
+    return *tokens;
+}
+
+void HighlightCache::set_window(std::size_t first, std::size_t last) {
+    if (first >= window_first + window.size() || last <= window_first) {
+        window.clear();
+        window_first = first;
+    }
+    for (; window_first < first; window_first++)
+        window.pop_front();
+    for (; window_first > first; window_first--)
+        window.emplace_front();
+    window.resize(last - first);
+}
+
+void HighlightCache::forget(std::size_t line) {
+    line = std::max(line, base);
+    if (line >= end())
+        return;
+    invalid.erase(line, end());
+    lines.resize(line - base);
+}
+
+void HighlightCache::rebase(std::size_t first) {
+    if (first >= base && first <= end()) {
+        base_state = state_before(first);
+        invalid.erase(base, first);
+        lines.erase(0, first - base);
+    } else {
+        invalid.erase(base, end());
+        lines.resize(0);
+        base_state = LexState::Normal;
+    }
+    base = first;
+}
+
+const std::vector<Token> &HighlightCache::tokens(std::size_t line, std::string_view text) {
+    assert(valid(line));
+    if (line >= window_first && line - window_first < window.size()) {
+        const std::optional<std::vector<Token>> &tokens = window[line - window_first];
+        if (tokens)
+            return *tokens;
+    }
+    std::vector<Token> &tokens = lex_into(line);
+    lex_line(text, at(line).start_state, tokens);
+    return tokens;
+}
+
+void HighlightCache::edit_line(std::size_t line) {
+    if (line >= window_first && line - window_first < window.size())
+        window[line - window_first].reset();
+    if (line >= base && line < end())
+        invalid.insert(line);
+}
+
+void HighlightCache::insert_lines(std::size_t line, std::size_t count) {
+    if (line < window_first)
+        window_first += count;
+    else if (line - window_first < window.size())
+        window.insert(window.begin() + (line - window_first), count, std::nullopt);
+
+    if (line < base) {
+        base += count;
+        invalid.shift(line, count);
+        return;
+    }
+    if (line > end())
+        return;
+    invalid.shift(line, count);
+    lines.insert(line - base, count);
+    for (std::size_t i = line; i < line + count; i++)
+        invalid.insert(i);
+}
+
+void HighlightCache::remove_lines(std::size_t line, std::size_t count) {
+    // Lines removed from the window, and lines shifting it up.
+    std::size_t first = std::max(line, window_first);
+    std::size_t last = std::min(line + count, window_first + window.size());
+    if (first < last)
+        window.erase(window.begin() + (first - window_first), window.begin() + (last - window_first));
+    window_first -= std::min(window_first, line + count) - std::min(window_first, line);
+
+    if (line + count <= base) {
+        base -= count;
+        invalid.shift(line + count, -(std::ptrdiff_t)count);
+        return;
+    }
+    if (line < base) {
+        // Cached lines at the start go too, the rest starts at `line`.
+        lines.erase(0, std::min(line + count, end()) - base);
+        invalid.shift(line + count, -(std::ptrdiff_t)count);
+        base = line;
+        edit_line(line);
+        return;
+    }
+    if (line >= end())
+        return;
+    count = std::min(count, end() - line);
+    lines.erase(line - base, count);
+    invalid.shift(line + count, -(std::ptrdiff_t)count);
+    // The line moving up has a new predecessor.
+    edit_line(line);
+}
+
+std::pair<std::size_t, std::size_t>
+HighlightCache::update(std::size_t stop, const std::function<std::string(std::size_t)> &line_text,
+                       std::size_t budget) {
+    std::size_t first = stop, last = 0;
+
+    std::size_t i = first_stale();
+    while (i < stop && budget > 0) {
+        if (i < end() && !invalid.contains(i)) {
+            // Valid, skip ahead to the next invalid line (or the end of the cache).
+            i = std::min(invalid.lower_bound(i), end());
+            continue;
+        }
+
+        if (i == end())
+            lines.push_back(Line{});
+        LexState state = state_before(i);
+
+        Line &line = at(i);
+        line.start_state = state;
+        line.end_state = lex_line(line_text(i), state, lex_into(i));
+        invalid.erase(i);
+        budget--;
+
+        first = std::min(first, i);
+        last = i + 1;
+
+        // Keep going until the state handed on matches what the next
+        // line was lexed in.
+        if (i + 1 < end() && at(i + 1).start_state != line.end_state)
+            invalid.insert(i + 1);
+        i++;
+    }
+
+    return {first, std::max(first, last)};
+}
+
+std::tuple<std::size_t, std::size_t, bool>
+HighlightCache::install(std::size_t first, std::vector<Line> &&batch) {
+    assert(first >= base && first <= end());
+    if (batch.empty())
+        return {first, first, true};
+
+    bool consistent = state_before(first) == batch.front().start_state;
+    std::size_t last = first + batch.size();
+    if (last > end())
+        lines.resize(last - base);
+    for (std::size_t i = 0; i < batch.size(); i++) {
+        at(first + i) = batch[i];
+        if (first + i >= window_first && first + i - window_first < window.size())
+            window[first + i - window_first].reset();
+    }
+
+    invalid.erase(first, last);
+    if (!consistent)
+        invalid.insert(first);
+    else if (last < end() && at(last).start_state != at(last - 1).end_state)
+        invalid.insert(last);
+    return {first, last, consistent};
+}
+
+void HighlightWorker::start(RopeNode *root, std::size_t line, std::size_t end, LexState state) {
+    assert(!running());
+    snapshot = root;
+    rope_collector().add_root(&snapshot);
+    rope_collector().pin();
+
+    head = tail = new Batch;
+    shift = 0;
+    next_line = line;
+    cancelled.store(false, std::memory_order_relaxed);
+    thread = std::thread(&HighlightWorker::run, this, line, end, state);
+}
+
+void HighlightWorker::publish(Batch *batch) {
+    tail->next.store(batch, std::memory_order_release);
+    tail = batch;
+}
+
+void HighlightWorker::run(std::size_t line, std::size_t end, LexState state) {
+    RopeCursor cursor(snapshot, snapshot->offset_of_line(line));
+    std::string text;
+    std::vector<Token> tokens;
+
+    auto batch = std::make_unique<Batch>();
+    batch->first_line = line;
+    auto note_read = [&](const char *p, std::size_t length) {
+        std::vector<std::string_view> &read = batch->read;
+        if (!read.empty() && read.back().data() + read.back().size() == p)
+            read.back() = {read.back().data(), read.back().size() + length};
+        else
+            read.emplace_back(p, length);
+    };
+    auto lex = [&]() {
+        HighlightCache::Line &result = batch->lines.emplace_back();
+        result.start_state = state;
+        tokens.clear();
+        result.end_state = state = lex_line(text, state, tokens);
+        text.clear();
+        if (batch->lines.size() == batch_size) {
+            std::size_t next = batch->first_line + batch_size;
+            publish(batch.release());
+            batch = std::make_unique<Batch>();
+            batch->first_line = next;
+        }
+    };
+
+    for (; line < end; line++) {
+        // The line may span several leaves, the last one ends at the end.
+        while (!cursor.at_end()) {
+            if (cancelled.load(std::memory_order_relaxed))
+                return;
+            std::string_view chunk = cursor.chunk();
+            const char *newline = static_cast<const char *>(
+                std::memchr(chunk.data(), '\n', chunk.size()));
+            if (newline == nullptr) {
+                text.append(chunk);
+                note_read(chunk.data(), chunk.size());
+                cursor.next_chunk();
+            } else {
+                std::size_t length = newline - chunk.data();
+                text.append(chunk.data(), length);
+                note_read(chunk.data(), length + 1);
+                cursor.seek(cursor.offset() + length + 1);
+                break;
+            }
+        }
+        lex();
+    }
+
+    batch->last = true;
+    publish(batch.release());
+}
+
+void HighlightWorker::finish() {
+    thread.join();
+    while (head != nullptr) {
+        Batch *next = head->next.load(std::memory_order_acquire);
+        delete head;
+        head = next;
+    }
+    tail = nullptr;
+    rope_collector().unpin();
+    rope_collector().remove_root(&snapshot);
+    snapshot = nullptr;
+}
+
+void HighlightWorker::cancel() {
+    if (!running())
+        return;
+    cancelled.store(true, std::memory_order_relaxed);
+    finish();
+}
+
+void HighlightWorker::edited(std::size_t first, std::size_t last, std::ptrdiff_t delta) {
+    if (!running())
+        return;
+    if (last <= next_line) {
+        shift += delta;
+        next_line += delta;
+    } else {
+        cancel();
+    }
+}
+
+std::pair<std::size_t, std::size_t>
+HighlightWorker::poll(HighlightCache &cache, const std::function<void(std::string_view)> &read) {
+    if (!running())
+        return {0, 0};
+
+    std::size_t first = std::numeric_limits<std::size_t>::max(), last = 0;
+    bool done = false;
+    while (Batch *batch = head->next.load(std::memory_order_acquire)) {
+        delete head;
+        head = batch;
+
+        std::size_t line = batch->first_line + shift;
+        if (line < cache.start() || line > cache.end()) {
+            // The cache lost lines we were counting on, start over.
+            cancel();
+            break;
+        }
+        for (std::string_view text : batch->read)
+            read(text);
+        auto [from, to, consistent] = cache.install(line, std::move(batch->lines));
+        first = std::min(first, from);
+        last = std::max(last, to);
+        next_line = to;
+        // The rest of the job was lexed in the wrong state.
+        if (!consistent) {
+            cancel();
+            break;
+        }
+        if (batch->last) {
+            done = true;
+            break;
+        }
+    }
+    if (done)
+        finish();
+
+    return {std::min(first, last), last};
+}
@@ -0,0 +1,249 @@
+#pragma once
+
+#include <atomic>
+#include <deque>
+#include <functional>
+#include <limits>
+#include <optional>
+#include <set>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <tuple>
+#include <utility>
+#include <vector>
+
+#include "gap.hh"
+#include "lexer.hh"
+#include "rope.hh"
+
+/**
+ * Ordered set of line numbers that follows lines being inserted and
+ * removed. Lines past the last edit are stored less an offset, so a
+ * run of edits near each other shifts them by updating the offset,
+ * only lines between the edits change sides.
+ */
+class LineSet {
+    // Lines before `split`, and lines at or after it less `offset`.
+    std::set<std::size_t> before;
+    std::set<std::ptrdiff_t> after;
+    std::size_t split = 0;
+    std::ptrdiff_t offset = 0;
+
+    void move_split(std::size_t to);
+public:
+    static constexpr std::size_t npos = std::numeric_limits<std::size_t>::max();
+
+    bool empty() const { return before.empty() && after.empty(); }
+    bool contains(std::size_t line) const {
+        return line < split ? before.count(line) != 0 : after.count((std::ptrdiff_t)line - offset) != 0;
+    }
+    void insert(std::size_t line) {
+        if (line < split)
+            before.insert(line);
+        else
+            after.insert((std::ptrdiff_t)line - offset);
+    }
+    void erase(std::size_t line) {
+        if (line < split)
+            before.erase(line);
+        else
+            after.erase((std::ptrdiff_t)line - offset);
+    }
+    // Remove lines [first, last).
+    void erase(std::size_t first, std::size_t last);
+
+    // First line at or after `line`, or npos.
+    std::size_t lower_bound(std::size_t line) const;
+
+    /**
+     * Lines at or after `from` move by `delta`, and if negative, lines
+     * [from + delta, from) are dropped.
+     */
+    void shift(std::size_t from, std::ptrdiff_t delta);
+};
+
+/**
+ * Per-line cache of the lexer states a range of lines starts and ends
+ * in, with the highlighted tokens of the lines in a window (the visible
+ * ones). Lines outside the window cost two bytes, their tokens are
+ * lexed again from the cached state when they come into view.
+ *
+ * The range starts at line 0, or wherever the cache was last rebased
+ * to (see `rebase()`), so the cost of highlighting doesn't depend on
+ * how far into a file the view is. The state at the start of the range
+ * is then a guess.
+ *
+ * Edits invalidate single lines. Re-lexing proceeds forward from an
+ * invalid line only until the state handed to the next line matches
+ * the one it was lexed in, so an edit costs O(changed lines) unless it
+ * e.g. opens a block comment.
+ */
+class HighlightCache {
+public:
+    struct Line {
+        LexState start_state = LexState::Normal;
+        LexState end_state = LexState::Normal;
+    };
+private:
+    // Cached lines, [base, base + lines.size()).
+    GapBuffer<Line> lines;
+    std::size_t base = 0;
+    // State line `base` is lexed in.
+    LexState base_state = LexState::Normal;
+    // Cached lines that need to be lexed again.
+    LineSet invalid;
+
+    // Tokens of lines [window_first, window_first + window.size()),
+    // unset until lexed.
+    std::deque<std::optional<std::vector<Token>>> window;
+    std::size_t window_first = 0;
+    // Tokens of the last line lexed outside the window.
+    std::vector<Token> scratch;
+
+    Line &at(std::size_t line) { return lines[line - base]; }
+    const Line &at(std::size_t line) const { return lines[line - base]; }
+
+    // Cleared tokens to lex `line` into.
+    std::vector<Token> &lex_into(std::size_t line);
+public:
+    // The contents of `line` changed.
+    void edit_line(std::size_t line);
+    // `count` new lines were inserted before `line`.
+    void insert_lines(std::size_t line, std::size_t count);
+    // Lines [line, line + count) were removed.
+    void remove_lines(std::size_t line, std::size_t count);
+
+    /**
+     * Bring lines [start(), stop) up to date, fetching their text
+     * through `line_text`. Gives up after lexing `budget` lines. Returns
+     * the range of lines that were (re-)lexed.
+     */
+    std::pair<std::size_t, std::size_t>
+    update(std::size_t stop, const std::function<std::string(std::size_t)> &line_text,
+           std::size_t budget = std::numeric_limits<std::size_t>::max());
+
+    /**
+     * Store lines lexed elsewhere (see `HighlightWorker`) starting at
+     * `first`, which must be within [start(), end()]. Returns
+     * the range of lines stored, and false if the first of them was
+     * lexed in a state other than the one its predecessor ends in.
+     */
+    std::tuple<std::size_t, std::size_t, bool>
+    install(std::size_t first, std::vector<Line> &&batch);
+
+    /**
+     * Keep tokens for lines [first, last) only, dropping those of the
+     * lines leaving the window.
+     */
+    void set_window(std::size_t first, std::size_t last);
+
+    // Drop lines from `line` on, they are lexed again once needed.
+    void forget(std::size_t line);
+
+    /**
+     * Start the cache at `first`, dropping the lines before it. If the
+     * cache doesn't reach `first`, everything goes and `first` is
+     * guessed to start in `LexState::Normal`.
+     */
+    void rebase(std::size_t first);
+
+    std::size_t start() const { return base; }
+    std::size_t end() const { return base + lines.size(); }
+    bool valid(std::size_t line) const {
+        return line >= base && line < end() && !invalid.contains(line);
+    }
+    // First line that is either invalid or not cached at all.
+    std::size_t first_stale() const { return std::min(invalid.lower_bound(base), end()); }
+    LexState end_state(std::size_t line) const { return at(line).end_state; }
+    // State `line` is to be lexed in, for lines in [start(), end()].
+    LexState state_before(std::size_t line) const {
+        return line == base ? base_state : at(line - 1).end_state;
+    }
+
+    /**
+     * Tokens of an up to date line, lexed from `text` unless cached in
+     * the window. Outside the window they last until the next call.
+     */
+    const std::vector<Token> &tokens(std::size_t line, std::string_view text);
+};
+
+/**
+ * Lexes a document in the background, from a given line to a bit past
+ * the view, so that scrolling far ahead doesn't stall on lexing every
+ * line in between. Only lexer states are handed back, see
+ * `HighlightCache`.
+ *
+ * The worker reads an immutable rope snapshot, pinned in the collector
+ * so compaction doesn't move nodes under it. Results are published in
+ * batches through a single producer, single consumer queue; `poll()`
+ * only does an acquire load per batch on the render path.
+ *
+ * Lines are numbered as in the snapshot. Edits before the first line
+ * not yet received only shift the numbering (see `edited()`), edits at
+ * or after it cancel the job.
+ */
+class HighlightWorker {
+    struct Batch {
+        std::size_t first_line = 0;
+        std::vector<HighlightCache::Line> lines;
+        // Text read for the lines, adjacent reads merged.
+        std::vector<std::string_view> read;
+        bool last = false;
+        std::atomic<Batch *> next{nullptr};
+    };
+
+    // Lines per batch.
+    static constexpr std::size_t batch_size = 4096;
+
+    std::thread thread;
+    std::atomic<bool> cancelled{false};
+
+    // Consumer end, an already consumed batch. Owned by the caller's thread.
+    Batch *head = nullptr;
+    // Producer end. Owned by the worker thread while it runs.
+    Batch *tail = nullptr;
+
+    // Registered and pinned with the collector while the job runs.
+    RopeNode *snapshot = nullptr;
+
+    // Snapshot line number to current line number.
+    std::ptrdiff_t shift = 0;
+    // First line (current numbering) not received yet.
+    std::size_t next_line = 0;
+
+    void run(std::size_t line, std::size_t end, LexState state);
+    void publish(Batch *batch);
+    void finish();
+public:
+    HighlightWorker() = default;
+    HighlightWorker(const HighlightWorker&) = delete;
+    HighlightWorker& operator=(const HighlightWorker&) = delete;
+    ~HighlightWorker() { cancel(); }
+
+    bool running() const { return thread.joinable(); }
+
+    /**
+     * Start lexing lines [line, end) of `root`, the first of which is
+     * lexed in `state`.
+     */
+    void start(RopeNode *root, std::size_t line, std::size_t end, LexState state);
+
+    /**
+     * Stop the job (waiting for at most a batch) and drop its results.
+     */
+    void cancel();
+
+    /**
+     * Lines [first, last) (current numbering) were edited, and `delta`
+     * lines inserted (or removed, if negative) after `first`.
+     */
+    void edited(std::size_t first, std::size_t last, std::ptrdiff_t delta);
+
+    /**
+     * Install published batches into `cache`, passing the text read for
+     * them to `read`. Returns the range of lines installed.
+     */
+    std::pair<std::size_t, std::size_t>
+    poll(HighlightCache &cache, const std::function<void(std::string_view)> &read);
+};
@@ -0,0 +1,123 @@
+#include "lexer.hh"
+
+#include <array>
+
+namespace {
+
+struct Word {
+    std::string_view word;
+    Face face;
+};
+
+constexpr Word words[] {
+    // Keywords.
+    {"if", Face::Keyword}, {"else", Face::Keyword}, {"do", Face::Keyword},
+    {"while", Face::Keyword}, {"switch", Face::Keyword}, {"case", Face::Keyword},
+    {"default", Face::Keyword}, {"break", Face::Keyword}, {"continue", Face::Keyword},
+    {"for", Face::Keyword}, {"return", Face::Keyword},
+    // Types.
+    {"void", Face::Type}, {"unsigned", Face::Type}, {"char", Face::Type},
+    {"bool", Face::Type}, {"short", Face::Type}, {"int", Face::Type},
+    {"long", Face::Type}, {"float", Face::Type}, {"double", Face::Type},
+    // Special values.
+    {"true", Face::Type}, {"false", Face::Type},
+};
+
+constexpr std::size_t table_size = 64;
+
+// NOTE: The constants are picked for `words` to be collision free,
+// `make_table()` fails to compile otherwise.
+constexpr std::size_t hash(std::string_view word) {
+    return (word.size() + 3 * (unsigned char)word.front()
+            + 13 * (unsigned char)word.back()) % table_size;
+}
+
+constexpr std::array<Word, table_size> make_table() {
+    std::array<Word, table_size> table{};
+    for (const Word &w : words) {
+        if (!table[hash(w.word)].word.empty())
+            throw "hash collision in keyword table";
+        table[hash(w.word)] = w;
+    }
+    return table;
+}
+
+constexpr std::array<Word, table_size> table = make_table();
+
+constexpr bool is_word_start(char c) {
+    return (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') || c == '_';
+}
+
+constexpr bool is_word(char c) {
+    return is_word_start(c) || (c >= '0' && c <= '9');
+}
+
+constexpr bool is_space(char c) {
+    return c == ' ' || c == '\t';
+}
+
+}
+
+Face classify_word(std::string_view word) {
+    if (word.empty()) return Face::Default;
+    const Word &candidate = table[hash(word)];
+    return candidate.word == word ? candidate.face : Face::Default;
+}
+
+LexState lex_line(std::string_view line, LexState state, std::vector<Token> &tokens) {
+    const std::size_t n = line.size();
+    std::size_t i = 0;
+
+    auto emit = [&](std::size_t start, std::size_t end, Face face) {
+        tokens.push_back({(std::uint32_t)start, (std::uint32_t)(end - start), face});
+    };
+
+    // Comments, returns false if the comment continues on the next line.
+    auto block_comment = [&](std::size_t start, std::size_t from) {
+        std::size_t end = line.find("*/", from);
+        i = end == std::string_view::npos ? n : end + 2;
+        emit(start, i, Face::Comment);
+        return end != std::string_view::npos;
+    };
+
+    if (state == LexState::BlockComment && !block_comment(0, 0))
+        return LexState::BlockComment;
+
+    // Preprocessor directives: `#` and the directive name.
+    while (i < n && is_space(line[i])) i++;
+    if (state == LexState::Normal && i < n && line[i] == '#') {
+        std::size_t start = i++;
+        while (i < n && is_space(line[i])) i++;
+        while (i < n && is_word(line[i])) i++;
+        emit(start, i, Face::Preprocessor);
+    }
+
+    while (i < n) {
+        char c = line[i];
+        if (is_word_start(c)) {
+            std::size_t start = i;
+            while (i < n && is_word(line[i])) i++;
+            Face face = classify_word(line.substr(start, i - start));
+            if (face != Face::Default)
+                emit(start, i, face);
+        } else if (c >= '0' && c <= '9') {
+            // Numbers (including suffixes), never highlighted.
+            while (i < n && is_word(line[i])) i++;
+        } else if (c == '"' || c == '\'') {
+            // Skip literals so their contents aren't mistaken for comments.
+            for (i++; i < n && line[i] != c; i++) {
+                if (line[i] == '\\') i++;
+            }
+            i++;
+        } else if (c == '/' && i + 1 < n && line[i + 1] == '/') {
+            emit(i, n, Face::Comment);
+            break;
+        } else if (c == '/' && i + 1 < n && line[i + 1] == '*') {
+            if (!block_comment(i, i + 2))
+                return LexState::BlockComment;
+        } else {
+            i++;
+        }
+    }
+    return LexState::Normal;
+}
@@ -0,0 +1,32 @@
+#pragma once
+
+#include <cstdint>
+#include <string_view>
+#include <vector>
+
+#include "screen.hh"
+
+struct Token {
+    std::uint32_t start;
+    std::uint32_t length;
+    Face face;
+};
+
+/**
+ * Face of a word, `Face::Default` unless it is a keyword, type or
+ * special literal. Constant time, a perfect hash and one comparison.
+ */
+Face classify_word(std::string_view word);
+
+// Lexer state carried from the end of one line to the next.
+enum class LexState : std::uint8_t {
+    Normal,
+    BlockComment
+};
+
+/**
+ * Scan a single line starting in `state`, appending its highlighted
+ * (non-default) spans to `tokens` in order. Returns the state at the
+ * end of the line. Allocates nothing beyond growing `tokens`.
+ */
+LexState lex_line(std::string_view line, LexState state, std::vector<Token> &tokens);
@@ -0,0 +1,118 @@
+#include "loop.hh"
+
+#include <algorithm>
+#include <cassert>
+#include <cerrno>
+#include <csignal>
+#include <fcntl.h>
+#include <poll.h>
+#include <system_error>
+#include <unistd.h>
+
+// Self-pipe, [0] is read by the loop and [1] written by the handler.
+static int signal_pipe[2] = {-1, -1};
+
+static void signal_handler(int signal) {
+    int saved = errno;
+    unsigned char byte = signal;
+    // NOTE: A full pipe already has this signal pending.
+    (void) !write(signal_pipe[1], &byte, 1);
+    errno = saved;
+}
+
+EventLoop::EventLoop() {
+    assert(signal_pipe[0] == -1);
+    if (pipe2(signal_pipe, O_NONBLOCK | O_CLOEXEC) == -1)
+        throw std::system_error(errno, std::generic_category(), "pipe");
+    idle_due = std::chrono::steady_clock::now();
+}
+
+EventLoop::~EventLoop() {
+    for (const Signal &s : signals)
+        std::signal(s.signal, SIG_DFL);
+    close(signal_pipe[0]);
+    close(signal_pipe[1]);
+    signal_pipe[0] = signal_pipe[1] = -1;
+}
+
+void EventLoop::watch(int fd, std::function<void()> readable, std::function<void()> closed) {
+    watches.push_back({fd, std::move(readable), std::move(closed)});
+}
+
+void EventLoop::on_signal(int signal, std::function<void()> raised) {
+    signals.push_back({signal, std::move(raised)});
+
+    struct sigaction action = {};
+    action.sa_handler = signal_handler;
+    sigemptyset(&action.sa_mask);
+    action.sa_flags = SA_RESTART;
+    sigaction(signal, &action, nullptr);
+}
+
+void EventLoop::on_idle(std::function<bool()> work) {
+    idle.push_back(std::move(work));
+}
+
+void EventLoop::dispatch_signals() {
+    unsigned char pending[64];
+    ssize_t n;
+    while ((n = read(signal_pipe[0], pending, sizeof(pending))) > 0) {
+        for (const Signal &s : signals) {
+            if (std::find(pending, pending + n, s.signal) != pending + n)
+                s.raised();
+        }
+    }
+}
+
+void EventLoop::run_idle() {
+    idle_pending = false;
+    for (auto &work : idle) {
+        if (work())
+            idle_pending = true;
+    }
+    idle_due = std::chrono::steady_clock::now() + idle_interval;
+}
+
+void EventLoop::wait() {
+    using namespace std::chrono;
+
+    std::vector<pollfd> fds;
+    fds.push_back({signal_pipe[0], POLLIN, 0});
+    for (const Watch &w : watches)
+        fds.push_back({w.fd, POLLIN, 0});
+
+    int timeout = -1;
+    if (idle_pending) {
+        auto left = duration_cast<milliseconds>(idle_due - steady_clock::now()).count();
+        timeout = std::max<int>(0, left);
+    }
+
+    int n = poll(fds.data(), fds.size(), timeout);
+    if (n == -1 && errno != EINTR)
+        throw std::system_error(errno, std::generic_category(), "poll");
+
+    if (n > 0) {
+        if (fds[0].revents)
+            dispatch_signals();
+        for (std::size_t i = 1; i < fds.size(); i++) {
+            if (fds[i].revents & POLLIN)
+                watches[i - 1].readable();
+        }
+        // Polling a closed fd returns at once, forever, so stop.
+        for (std::size_t i = fds.size() - 1; i > 0; i--) {
+            if (fds[i].revents & (POLLHUP | POLLERR | POLLNVAL)) {
+                std::function<void()> closed = std::move(watches[i - 1].closed);
+                watches.erase(watches.begin() + (i - 1));
+                closed();
+            }
+        }
+        // Whatever happened may have left work behind.
+        if (!idle_pending) {
+            idle_pending = true;
+            idle_due = steady_clock::now() + idle_interval;
+        }
+    }
+
+    if (idle_pending && steady_clock::now() >= idle_due)
+        run_idle();
+}
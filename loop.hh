@@ -0,0 +1,66 @@
+#pragma once
+
+#include <chrono>
+#include <functional>
+#include <vector>
+
+/**
+ * Single threaded event loop around poll(2), so the editor sleeps
+ * while there is nothing to do.
+ *
+ * Signals are passed through a self-pipe written by the handler, their
+ * callbacks run from `wait()` like any other. Idle work runs every
+ * `idle_interval` for as long as it has anything left to do.
+ *
+ * There is one loop per process, the signal handlers share a pipe.
+ */
+class EventLoop {
+    struct Watch {
+        int fd;
+        std::function<void()> readable;
+        std::function<void()> closed;
+    };
+    struct Signal {
+        int signal;
+        std::function<void()> raised;
+    };
+
+    std::vector<Watch> watches;
+    std::vector<Signal> signals;
+    std::vector<std::function<bool()>> idle;
+
+    // Whether idle work may have something left, and when to run it.
+    bool idle_pending = true;
+    std::chrono::steady_clock::time_point idle_due;
+
+    void dispatch_signals();
+    void run_idle();
+public:
+    std::chrono::milliseconds idle_interval{5};
+
+    EventLoop();
+    ~EventLoop();
+
+    EventLoop(const EventLoop&) = delete;
+    EventLoop& operator=(const EventLoop&) = delete;
+
+    /**
+     * Call `readable` whenever `fd` has input, and `closed` once it hangs
+     * up or fails (after reading what is left), it isn't watched after.
+     */
+    void watch(int fd, std::function<void()> readable, std::function<void()> closed);
+
+    // Call `raised` from `wait()` after `signal` was delivered.
+    void on_signal(int signal, std::function<void()> raised);
+
+    /**
+     * Run `work` while idle until it returns false. Any other event
+     * may give it more to do, so it is run again after one.
+     */
+    void on_idle(std::function<bool()> work);
+
+    /**
+     * Block until something happens and dispatch it.
+     */
+    void wait();
+};
@@ -10,16 +10,22 @@
 #include <memory>
 #include <algorithm>
 #include <locale>
+#include <cassert>
+#include <cstdlib>
+#include <system_error>
+#include <functional>
+#include <optional>
 
 #include "term.hh"
 #include "frame.hh"
 #include "buffer.hh"
 #include "rope.hh"
 #include "arena.hh"
-
-void resize_handler(int) {
-    active_frame().update_size();
-}
+#include "gc.hh"
+#include "file.hh"
+#include "loop.hh"
+#include "search.hh"
+#include "utf8.hh"
 
 std::string open(std::string path) {
     std::ifstream ifs;
@@ -28,78 +34,630 @@ std::string open(std::string path) {
                        std::istreambuf_iterator<char>{});
 }
 
-bool tick() {
-    Frame& frame = active_frame();
-    if (frame.is_marked_for_update()) {
-        show_cursor(false);
-        for (auto &b : frame.buffers) {
-            b->draw(0, 0, frame._cols, frame._rows);
+IncrementalSearch isearch;
+RegexSearch regex_search;
+// Whether the previous key was the C-x prefix.
+bool ctrl_x = false;
+
+/**
+ * Handle a single key press, returns false to quit.
+ */
+bool handle_key(Key key) {
+    Buffer& active_buffer = active_frame().active_buffer();
+    if (key != Key::KEY_NULL && isearch.active() && isearch.handle_key(active_buffer, key)) {
+        active_frame().restore_cursor_position();
+        return true;
+    }
+    if (key != Key::KEY_NULL && regex_search.active() && regex_search.handle_key(active_buffer, key)) {
+        active_frame().restore_cursor_position();
+        return true;
+    }
+
+    if (ctrl_x && key != Key::KEY_NULL) {
+        ctrl_x = false;
+        active_frame().set_status("");
+        switch (key) {
+        case Key::CTRL_S: active_buffer.save(); break;
+        case Key::CTRL_C: return false;
+        default: break;
         }
-        frame.restore_cursor_position();
-        show_cursor(true);
+        return true;
     }
 
-    Buffer& active_buffer = active_frame().active_buffer();
-    Key key = read_key(STDIN_FILENO);
     switch (key) {
     case Key::CTRL_C: return false;
+    case Key::CTRL_X:
+        ctrl_x = true;
+        active_frame().set_status("C-x-");
+        return true;
     case Key::ARROW_RIGHT: active_buffer.cursor_right(); break;
     case Key::ARROW_LEFT: active_buffer.cursor_left(); break;
     case Key::ARROW_UP: active_buffer.cursor_up(); break;
     case Key::ARROW_DOWN: active_buffer.cursor_down(); break;
+    case Key::PAGE_UP: active_buffer.page_up(); break;
+    case Key::PAGE_DOWN: active_buffer.page_down(); break;
     case Key::BACKSPACE: active_buffer.delete_backward(); break;
     case Key::DEL_KEY: active_buffer.delete_forward(); break;
     case Key::CTRL_K: active_buffer.kill_line(); break;
     case Key::CTRL_A: active_buffer.beginning_of_line(); break;
     case Key::CTRL_E: active_buffer.end_of_line(); break;
+    case Key::CTRL_S: isearch.start(active_buffer, true); break;
+    case Key::CTRL_R: isearch.start(active_buffer, false); break;
+    case Key::CTRL_F: regex_search.start(active_buffer); break;
     case Key::ENTER: active_buffer.new_line(); break;
-    case Key::KEY_NULL: break;
+    case Key::PASTE_START: active_buffer.insert(read_paste(STDIN_FILENO)); break;
+    case Key::KEY_NULL: return true;
     default:
-        if (std::isprint((char) key)) {
+        if (key >= 0x80 && key < 0x100) {
+            active_buffer.insert(read_codepoint(STDIN_FILENO, key));
+        } else if (key < 0x80 && std::isprint(key)) {
             active_buffer.insert((char) key);
         } else {
             // TODO: Handle unknown key.
         }
     }
 
-
+    active_buffer.scroll_to_cursor();
     active_frame().restore_cursor_position();
-
     return true;
 }
 
-int main(int argc, char* argv[]) {
-    Arena<RopeNode> arena(60);
+/**
+ * Bring the screen up to date, then wait for and handle the next
+ * events.
+ */
+void tick(EventLoop &loop) {
+    Frame& frame = active_frame();
+    if (frame.is_marked_for_update())
+        frame.render();
+    flush_output();
 
-    auto* a = make_rope("hello_");
-    auto* b = make_rope("my_");
-    auto* c = make_rope("na");
-    auto* d = make_rope("me_i");
-    auto* e = make_rope("s");
-    auto* f = make_rope("_simon");
+    loop.wait();
+}
+
+std::string random_text(std::size_t length, std::string_view alphabet) {
+    std::string text;
+    for (std::size_t i = 0; i < length; i++)
+        text += alphabet[std::rand() % alphabet.size()];
+    return text;
+}
 
-    auto* root = a; //->concat(b)->concat(c)->concat(d)->concat(e)->concat(f);
-    // root = insert(root, "hello, world", 3);
-    // std::cout << render(root) << std::endl;
+/**
+ * Hammer a rope with random edits, asserting that it stays balanced,
+ * then a lazily indexed one with edits mixed into its indexing.
+ */
+void check_rope() {
+    auto* root = make_rope("hello_my_name_is_simon");
+    rope_collector().add_root(&root);
+    std::size_t length = root->length;
+    for (int i = 0; i < 10000; i++) {
+        if (std::rand() % 3 == 0 && length > 0) {
+            root = root->kill(std::rand() % length, 1);
+            length--;
+        } else {
+            root = root->insert(std::rand() % 4 ? "x" : "\n", std::rand() % (length + 1));
+            length++;
+        }
+        assert(root->length == length);
+        assert(root->verify() == root->node_count());
 
-    root = root->insert("anus", 3);
-    root->dump();
+        std::size_t line = std::rand() % root->line_count();
+        assert(root->line_of_offset(root->offset_of_line(line)) == line);
 
-    for (char c : *root) {
-        std::cout << (int)c << "(" << c << ") ";
+        if (i % 1000 == 0) {
+            rope_collector().collect();
+            assert(root->verify() == Arena<RopeNode>::current->size());
+        }
     }
+    rope_collector().remove_root(&root);
+    std::cout << "length: " << root->length
+              << ", lines: " << root->line_count()
+              << ", depth: " << root->depth()
+              << ", nodes: " << root->node_count() << std::endl
+              << "arena: " << Arena<RopeNode>::current->size() << " allocated, "
+              << Arena<RopeNode>::current->high_water_mark() << " high water, "
+              << Arena<RopeNode>::current->capacity() << " capacity" << std::endl;
 
-    return 0;
-    signal(SIGWINCH, resize_handler);
+    // Small leaves so that indexing, refining and editing all cross
+    // leaf boundaries. Edits only go into the indexed prefix, as in
+    // RopeBuffer, which refines the leaf under them first.
+    std::size_t lazy_leaf = RopeNode::lazy_leaf, max_leaf = RopeNode::max_leaf;
+    RopeNode::lazy_leaf = 64;
+    RopeNode::max_leaf = 16;
+    const std::string source = random_text(16000, "ab\nc");
+    std::string text = source;
+    root = make_lazy_rope(source.data(), source.size());
+    rope_collector().add_root(&root);
+    for (int i = 0; i < 2000; i++) {
+        std::size_t indexed = root->indexed_length();
+        if (std::rand() % 10 == 0 || indexed == 0) {
+            root = root->index(indexed + std::rand() % 32);
+        } else if (std::rand() % 3 == 0) {
+            std::size_t at = std::rand() % indexed;
+            root = root->refine(at)->kill(at, 1);
+            text.erase(at, 1);
+        } else {
+            std::size_t at = std::rand() % (indexed + 1);
+            const char *s = std::rand() % 4 ? "x" : "\n";
+            root = root->refine(at)->insert(s, at);
+            text.insert(at, s);
+        }
+        assert(root->verify() == root->node_count());
+        assert(root->render() == text);
+        indexed = root->indexed_length();
+        assert(root->newlines == (std::size_t)std::count(text.begin(), text.begin() + indexed, '\n'));
 
-    if (argc != 2) { return 1; }
-    active_frame().buffers.push_back(std::make_unique<StringBuffer>(open(argv[1])));
+        if (i % 500 == 0)
+            rope_collector().collect();
+    }
+    rope_collector().remove_root(&root);
+    RopeNode::lazy_leaf = lazy_leaf;
+    RopeNode::max_leaf = max_leaf;
+    std::cout << "lazy: " << root->indexed_length() << " of " << root->length << " indexed, "
+              << "nodes: " << root->node_count() << std::endl;
+}
 
-    active_frame().init();
+/**
+ * Rope over `text` cut into leaves of random (1 to `max_leaf` bytes)
+ * size, so matches straddle leaves.
+ */
+RopeNode *chunked_rope(const std::string &text, std::size_t max_leaf) {
+    RopeNode *root = nullptr;
+    for (std::size_t at = 0; at < text.size();) {
+        std::size_t length = std::min<std::size_t>(1 + std::rand() % max_leaf, text.size() - at);
+        root = RopeNode::join(root, new RopeNode(text.data() + at, length));
+        at += length;
+    }
+    return root ? root : make_rope("");
+}
+
+/**
+ * Longest match of `regex` at `at`, or -1, by walking its NFA state by
+ * state. Slow, but independent of the lazy DFA. Call with increasing
+ * `at` for each line, starting from 0.
+ */
+std::ptrdiff_t naive_match_at(const Regex &regex, std::string_view line, std::size_t at) {
+    // (state, position) pairs visited, stamped with the start position
+    // so one allocation serves the whole line.
+    static std::vector<std::size_t> seen;
+    if (at == 0)
+        seen.assign(regex.states.size() * (line.size() + 1), 0);
+
+    std::ptrdiff_t longest = -1;
+    std::function<void(int, std::size_t)> walk = [&](int state, std::size_t i) {
+        if (state < 0 || seen[state * (line.size() + 1) + i] == at + 1)
+            return;
+        seen[state * (line.size() + 1) + i] = at + 1;
+        const Regex::State &s = regex.states[state];
+        switch (s.kind) {
+        case Regex::State::Set:
+            if (i < line.size() && regex.sets[s.set][(unsigned char)line[i]])
+                walk(s.out, i + 1);
+            break;
+        case Regex::State::Split:
+            walk(s.out, i);
+            walk(s.out1, i);
+            break;
+        case Regex::State::LineStart:
+            if (i == 0)
+                walk(s.out, i);
+            break;
+        case Regex::State::LineEnd:
+            if (i == line.size())
+                walk(s.out, i);
+            break;
+        case Regex::State::Match:
+            longest = std::max<std::ptrdiff_t>(longest, i - at);
+            break;
+        }
+    };
+    walk(regex.start, at);
+    return longest;
+}
+
+// Leftmost-longest, non-overlapping matches, the slow way.
+std::vector<RegexMatch> naive_find_all(const Regex &regex, std::string_view text) {
+    std::vector<RegexMatch> matches;
+    std::size_t line_number = 0;
     while (true) {
-        if (!tick()) break;
+        std::size_t newline = text.find('\n');
+        std::string_view line = text.substr(0, newline);
+        auto next = [&](std::size_t at) { return at < line.size() ? next_codepoint(line, at) : at + 1; };
+        for (std::size_t at = 0; at <= line.size();) {
+            std::ptrdiff_t length = naive_match_at(regex, line, at);
+            if (length < 0) {
+                at = next(at);
+                continue;
+            }
+            matches.push_back({line_number, at, (std::size_t)length});
+            at = length > 0 ? at + length : next(at);
+        }
+        if (newline == std::string_view::npos)
+            return matches;
+        text.remove_prefix(newline + 1);
+        line_number++;
+    }
+}
+
+bool operator==(const RegexMatch &a, const RegexMatch &b) {
+    return a.line == b.line && a.column == b.column && a.length == b.length;
+}
+
+/**
+ * Compare substring and regex search on randomly chunked ropes against
+ * `std::string` and naive matching.
+ */
+void check_search() {
+    // Substring search, with matches straddling leaves.
+    std::size_t finds = 0;
+    for (int i = 0; i < 2000; i++) {
+        std::string text = random_text(std::rand() % 300, "ab\nc");
+        RopeNode *root = chunked_rope(text, 1 + std::rand() % 40);
+        std::size_t start = std::rand() % (text.size() + 1);
+        std::string needle = std::rand() % 2
+            ? text.substr(start, std::rand() % 12)
+            : random_text(std::rand() % 5, "ab\nc");
+
+        for (int j = 0; j < 20; j++) {
+            std::size_t from = std::rand() % (text.size() + 2);
+            std::optional<std::size_t> found = find(root, needle, from);
+            std::size_t expected = from <= text.size() ? text.find(needle, from) : std::string::npos;
+            assert(found.value_or(std::string::npos) == expected);
+
+            std::size_t end = std::min(from, text.size() + 1);
+            found = rfind(root, needle, from);
+            expected = end > 0 ? text.rfind(needle, end - 1) : std::string::npos;
+            assert(found.value_or(std::string::npos) == expected);
+            finds += 2;
+        }
+        assert(find(text, needle) == text.find(needle));
+        assert(rfind(text, needle) == text.rfind(needle));
+    }
+
+    // Regular expressions known to parse right...
+    struct Case { const char *pattern, *line; std::vector<std::pair<std::size_t, std::size_t>> matches; };
+    const Case cases[] = {
+        {"ab|c", "xabcab", {{1, 2}, {3, 1}, {4, 2}}},
+        {"a(b|cd)*e", "abcdbe ae ace", {{0, 6}, {7, 2}}},
+        {"[a-c]+", "xcabz", {{1, 3}}},
+        {"[^a-c ]+", "ab xyz c", {{3, 3}}},
+        {"[]a]", "]b", {{0, 1}}},
+        {"[a-]", "x-", {{1, 1}}},
+        {"\\d+\\s\\w", "x 12 a_", {{2, 4}}},
+        {"\\D\\W", "1a.", {{1, 2}}},
+        {"^a|b$", "abab", {{0, 1}, {3, 1}}},
+        {"^$", "", {{0, 0}}},
+        {"x?", "ax", {{0, 0}, {1, 1}, {2, 0}}},
+        {"a.c", "abc a\tc", {{0, 3}, {4, 3}}},
+        {"\\.\\*", "a.*b", {{1, 2}}},
+        // Whole codepoints, never part of one.
+        {"h.llo", "h\u00e9llo \u4e2d\u6587", {{0, 6}}},
+        {"\u4e2d.", "h\u00e9llo \u4e2d\u6587", {{7, 6}}},
+        {"[^a]", "\u00e9", {{0, 2}}},
+        {"\\W+", "a\u4e2d\u6587 b", {{1, 7}}},
+        {"[\u00e9\u4e2d-\u9fa5]+", "x\u00e9\u4e2d\u6587y", {{1, 8}}},
+        {"\u00e9*", "\u00e9\u00e9", {{0, 4}, {4, 0}}},
+        {"x*", "\u00e9", {{0, 0}, {2, 0}}},
+        {"a.b", "a\xff" "b a\xe6" "b", {{0, 3}}},
+    };
+    for (const Case &c : cases) {
+        Regex regex(c.pattern);
+        RegexMatcher matcher(regex);
+        std::vector<RegexMatch> matches;
+        matcher.find_all(c.line, 0, matches);
+        assert(matches.size() == c.matches.size());
+        for (std::size_t i = 0; i < matches.size(); i++)
+            assert(matches[i].column == c.matches[i].first && matches[i].length == c.matches[i].second);
+    }
+
+    // Classes against every codepoint.
+    const std::pair<const char *, std::function<bool(char32_t)>> classes[] = {
+        {".", [](char32_t c) { return c != '\n'; }},
+        {"\\W", [](char32_t c) { return !(c < 0x80 && (std::isalnum(c) || c == '_')); }},
+        {"[^a\u00e9\u4e2d-\u9fa5]", [](char32_t c) { return c != 'a' && c != 0xe9 && !(c >= 0x4e2d && c <= 0x9fa5); }},
+        {"[\u00e0-\u00ff\u0800\U00010000-\U0010ffff]", [](char32_t c) { return (c >= 0xe0 && c <= 0xff) || c == 0x800 || c >= 0x10000; }},
+    };
+    for (const auto &[pattern, member] : classes) {
+        Regex regex(pattern);
+        RegexMatcher matcher(regex);
+        for (char32_t c = 0; c <= 0x10ffff; c++) {
+            if (c >= 0xd800 && c <= 0xdfff)
+                continue;
+            std::string text;
+            encode_utf8(c, text);
+            assert(matcher.match_at(text, 0) == (member(c) ? (std::ptrdiff_t)text.size() : -1));
+        }
+    }
+
+    // ... then matched by the lazy DFA against walking their NFA.
+    const char *patterns[] = {
+        "a", "ab", "a|b", "(ab)*c", "a+b?", "[a-c]x", "[^ab]+", "\\d+", "\\w+\\s",
+        "\\D\\W", "^a", "b$", "^$", "^(a|b)*$", "x.y", "(a|ab)(c|bcd)", "a*", "",
+        "(a|b)*a(a|b)(a|b)(a|b)(a|b)(a|b)(a|b)(a|b)(a|b)(a|b)(a|b)(a|b)(a|b)(a|b)",
+        ".", "a.b", "[^a]+", "\\W\\w", "\u4e2d.", "[\u00e9-\u4e2d]+", "(\u00e9|\u6587)+",
+    };
+    std::size_t regex_matches = 0;
+    for (const char *pattern : patterns) {
+        Regex regex(pattern);
+        for (int i = 0; i < 50; i++) {
+            std::string text;
+            if (i == 0) {
+                // Long enough to be split over the thread pool, long
+                // lines of a and b to overflow the DFA and trim it.
+                while (text.size() < (1 << 17))
+                    text += random_text(std::rand() % 80, "ab") + "\n";
+                for (int line = 0; line < 16; line++)
+                    text += "\n" + random_text(400, "ab");
+            } else if (i % 2) {
+                text = random_text(std::rand() % 200, "abcxy1 _.\n");
+            } else {
+                // UTF-8, with some stray bytes.
+                const char *pieces[] = {"a", "b", " ", "\n", "\u00e9", "\u4e2d", "\u6587", "\U0001f600", "\xff", "\x80", "\xe6"};
+                for (int j = std::rand() % 100; j > 0; j--)
+                    text += pieces[std::rand() % std::size(pieces)];
+            }
+            RopeNode *root = chunked_rope(text, 1 + std::rand() % 64);
+
+            std::vector<RegexMatch> found = find_all(root, regex);
+            std::vector<RegexMatch> expected = naive_find_all(regex, text);
+            assert(found == expected);
+            regex_matches += found.size();
+        }
     }
+
+    std::cout << "find/rfind: " << finds << " searches, "
+              << "regex: " << regex_matches << " matches" << std::endl;
+}
+
+/**
+ * Whether `s` is valid UTF-8, decoding it the slow and obvious way.
+ */
+bool naive_valid_utf8(std::string_view s) {
+    for (std::size_t i = 0; i < s.size();) {
+        unsigned char lead = s[i];
+        std::size_t length = lead < 0x80 ? 1 : lead >> 5 == 6 ? 2 : lead >> 4 == 14 ? 3 : lead >> 3 == 30 ? 4 : 0;
+        if (length == 0 || i + length > s.size())
+            return false;
+        char32_t c = length == 1 ? lead : lead & (0xff >> (length + 1));
+        for (std::size_t j = 1; j < length; j++) {
+            if (((unsigned char)s[i + j] & 0xc0) != 0x80)
+                return false;
+            c = c << 6 | (s[i + j] & 0x3f);
+        }
+        const char32_t shortest[] = {0, 0, 0x80, 0x800, 0x10000};
+        if (c < shortest[length] || c > 0x10ffff || (c >= 0xd800 && c <= 0xdfff))
+            return false;
+        i += length;
+    }
+    return true;
+}
+
+// Bytes mostly making up UTF-8, with some that don't.
+std::string random_utf8(std::size_t length) {
+    static const char *pieces[] = {
+        "a", "\n", "\u00e9", "\u4e2d", "\U0001f600", "\u0301", "\xc3", "\xa9", "\xed\xa0\x80",
+        "\xc0\x80", "\xf4\x90\x80\x80", "\xff",
+    };
+    std::string text;
+    while (text.size() < length)
+        text += std::rand() % 4 ? pieces[std::rand() % 6] : pieces[std::rand() % std::size(pieces)];
+    return text;
+}
+
+/**
+ * Check the vectorized scans against the scalar ones, validation
+ * against decoding by hand, and column and codepoint conversions
+ * against walking the text a codepoint at a time.
+ */
+void check_utf8() {
+    // Every variant at every alignment, and past 255 blocks where the
+    // lane counts are summed up.
+    for (int i = 0; i < 3000; i++) {
+        std::string text = random_utf8(std::rand() % (i % 100 == 0 ? 20000 : 300));
+        std::size_t start = std::rand() % (text.size() + 1);
+        std::string_view s = std::string_view(text).substr(start);
+
+        TextMetrics expected;
+        for (char c : s) {
+            expected.newlines += c == '\n';
+            expected.codepoints += is_codepoint_start(c);
+        }
+        for (TextMetrics metrics : RopeNode::measure_each(s.data(), s.size()))
+            assert(metrics.newlines == expected.newlines && metrics.codepoints == expected.codepoints);
+
+        std::string plain = std::string(std::rand() % 100, 'a') + text;
+        std::size_t ascii = std::find_if(plain.begin(), plain.end(), [](char c) { return c & 0x80; }) - plain.begin();
+        for (std::size_t prefix : ascii_prefix_each(plain.data(), plain.size()))
+            assert(prefix == ascii);
+    }
+
+    // Encoding round trips.
+    for (char32_t c = 0; c <= 0x10ffff; c++) {
+        if (c >= 0xd800 && c <= 0xdfff)
+            continue;
+        std::string text;
+        encode_utf8(c, text);
+        std::size_t at = 0;
+        assert(decode_utf8(text, at) == c && at == text.size());
+        assert(valid_utf8(text));
+    }
+
+    // Overlong forms, surrogates and codepoints past U+10FFFF are
+    // rejected, also when split over several `feed()` calls.
+    const std::pair<const char *, bool> sequences[] = {
+        {"\xc2\x80", true}, {"\xdf\xbf", true}, {"\xe0\xa0\x80", true}, {"\xed\x9f\xbf", true},
+        {"\xee\x80\x80", true}, {"\xef\xbf\xbf", true}, {"\xf0\x90\x80\x80", true}, {"\xf4\x8f\xbf\xbf", true},
+        {"\xc0\x80", false}, {"\xc1\xbf", false}, {"\xe0\x9f\xbf", false}, {"\xf0\x8f\xbf\xbf", false},
+        {"\xed\xa0\x80", false}, {"\xed\xbf\xbf", false},
+        {"\xf4\x90\x80\x80", false}, {"\xf5\x80\x80\x80", false}, {"\xff", false},
+        {"\x80", false}, {"\xe6\xbc", false}, {"\xe6\xbc" "a", false}, {"\xc3\xa9\xa9", false},
+    };
+    for (auto [sequence, valid] : sequences) {
+        std::string text = std::string("x") + sequence + "y";
+        assert(valid_utf8(text) == valid && naive_valid_utf8(text) == valid);
+        for (std::size_t cut = 0; cut <= text.size(); cut++) {
+            Utf8Validator validator;
+            validator.feed(std::string_view(text).substr(0, cut));
+            validator.feed(std::string_view(text).substr(cut));
+            assert(validator.valid() == valid);
+        }
+        std::size_t at = 1;
+        assert((decode_utf8(text, at) != replacement_character) == valid);
+    }
+
+    std::size_t checked = 0;
+    for (int i = 0; i < 3000; i++) {
+        std::string text = random_utf8(std::rand() % 200);
+        if (std::rand() % 2)
+            text = std::string(std::rand() % 70, 'a') + text;
+
+        // Validation fed in random pieces.
+        Utf8Validator validator;
+        for (std::size_t at = 0; at < text.size();) {
+            std::size_t length = 1 + std::rand() % 40;
+            validator.feed(std::string_view(text).substr(at, length));
+            at += length;
+        }
+        assert(validator.valid() == naive_valid_utf8(text));
+
+        // Columns, a codepoint at a time.
+        std::vector<std::size_t> starts, columns, widths;
+        std::size_t width = 0;
+        for (std::size_t at = 0; at < text.size();) {
+            starts.push_back(at);
+            columns.push_back(width);
+            widths.push_back(codepoint_width(decode_utf8(text, at)));
+            width += widths.back();
+        }
+        assert(display_width(text) == width);
+        for (std::size_t k = 0; k < starts.size(); k++)
+            assert(display_width(std::string_view(text).substr(0, starts[k])) == columns[k]);
+        for (std::size_t column = 0; column <= width + 1; column++) {
+            // The last codepoint shown at or before `column`, with the
+            // zero width ones after it.
+            std::size_t expected = text.size();
+            for (std::size_t k = 0; k < starts.size(); k++) {
+                if (widths[k] > 0 && columns[k] + widths[k] > column) {
+                    expected = starts[k];
+                    break;
+                }
+            }
+            assert(offset_of_column(text, column) == expected);
+        }
+
+        // Codepoints in a chunked rope, counted by their first bytes
+        // (so leading continuation bytes aren't part of one).
+        starts.clear();
+        for (std::size_t at = 0; at < text.size(); at++) {
+            if (is_codepoint_start(text[at]))
+                starts.push_back(at);
+        }
+        RopeNode *root = chunked_rope(text, 1 + std::rand() % 16);
+        assert(root->codepoints == starts.size());
+        for (std::size_t offset = 0; offset <= text.size(); offset++) {
+            std::size_t codepoint = std::lower_bound(starts.begin(), starts.end(), offset) - starts.begin();
+            assert(root->codepoint_of_offset(offset) == codepoint);
+        }
+        for (std::size_t k = 0; k <= starts.size(); k++)
+            assert(root->offset_of_codepoint(k) == (k < starts.size() ? starts[k] : text.size()));
+        checked += text.size();
+    }
+
+    std::cout << "utf-8: " << checked << " bytes checked, measure and ascii_prefix variants: "
+              << RopeNode::measure_each("", 0).size() << std::endl;
+}
+
+void usage(const char *argv0) {
+    std::cerr << "usage: " << argv0 << " [--rope | --string] FILE" << std::endl
+              << "       " << argv0 << " --check-rope | --check-search | --check-utf8" << std::endl;
+}
+
+int main(int argc, char* argv[]) {
+    Arena<RopeNode> arena(1 << 14);
+
+    bool use_rope = false;
+    const char *path = nullptr;
+    for (int i = 1; i < argc; i++) {
+        std::string arg = argv[i];
+        if (arg == "--rope") {
+            use_rope = true;
+        } else if (arg == "--string") {
+            use_rope = false;
+        } else if (arg == "--check-rope") {
+            check_rope();
+            return 0;
+        } else if (arg == "--check-search") {
+            check_search();
+            return 0;
+        } else if (arg == "--check-utf8") {
+            check_utf8();
+            return 0;
+        } else if (path == nullptr && arg[0] != '-') {
+            path = argv[i];
+        } else {
+            usage(argv[0]);
+            return 1;
+        }
+    }
+    if (path == nullptr) {
+        usage(argv[0]);
+        return 1;
+    }
+
+    if (use_rope) {
+        try {
+            active_frame().buffers.push_back(std::make_unique<RopeBuffer>(MappedFile(path)));
+        } catch (const std::system_error &e) {
+            std::cerr << e.what() << std::endl;
+            return 1;
+        }
+    } else {
+        active_frame().buffers.push_back(std::make_unique<StringBuffer>(open(path)));
+    }
+    active_frame().active_buffer()._path = path;
+
+    EventLoop loop;
+    bool running = true;
+    loop.watch(STDIN_FILENO, [&] {
+        // Readable with nothing to read is the end of the input.
+        if (!input_pending(STDIN_FILENO)) {
+            running = false;
+            return;
+        }
+        // Handle everything that came in before drawing again.
+        do {
+            running = handle_key(read_key(STDIN_FILENO));
+        } while (running && input_pending(STDIN_FILENO));
+    }, [&] {
+        running = false;
+    });
+    loop.on_signal(SIGWINCH, [] {
+        active_frame().update_size();
+    });
+    // Spend idle time on background highlighting and collecting rope
+    // garbage.
+    loop.on_idle([] {
+        return active_frame().poll();
+    });
+    loop.on_idle([] {
+        // Nothing can complete while pinned. Unpinning happens in idle
+        // work too, which runs this again.
+        if (rope_collector().is_pinned())
+            return false;
+        if (rope_collector().in_progress() || rope_collector().should_collect())
+            rope_collector().step(1 << 14);
+        return rope_collector().in_progress();
+    });
+
+    active_frame().init();
+    while (running)
+        tick(loop);
+    bracketed_paste(false);
     clear(ClearOpt::Screen);
     set_cursor_position(0, 0);
+    flush_output();
+
+    // Buffers hold on to nodes in `arena`, let go of them first.
+    active_frame().buffers.clear();
     return 0;
 }
@@ -0,0 +1,52 @@
+#pragma once
+
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <future>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+class ThreadPool;
+
+ThreadPool &thread_pool();
+
+/**
+ * Fixed set of worker threads running queued tasks, for spreading work
+ * over every core. Tasks must not wait on other tasks.
+ */
+class ThreadPool {
+    std::vector<std::thread> workers;
+    std::deque<std::function<void()>> tasks;
+    std::mutex mutex;
+    std::condition_variable available;
+    bool stopping = false;
+
+    void work();
+public:
+    explicit ThreadPool(std::size_t threads);
+    ~ThreadPool();
+
+    ThreadPool(const ThreadPool&) = delete;
+    ThreadPool& operator=(const ThreadPool&) = delete;
+
+    std::size_t size() const { return workers.size(); }
+
+    /**
+     * Queue `task`, the returned future holds its result.
+     */
+    template<typename F>
+    auto submit(F task) -> std::future<decltype(task())> {
+        using Result = decltype(task());
+        auto packaged = std::make_shared<std::packaged_task<Result()>>(std::move(task));
+        std::future<Result> result = packaged->get_future();
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            tasks.emplace_back([packaged] { (*packaged)(); });
+        }
+        available.notify_one();
+        return result;
+    }
+};
@@ -0,0 +1,541 @@
+#include "regex.hh"
+#include "utf8.hh"
+
+#include <algorithm>
+#include <cctype>
+#include <optional>
+#include <stdexcept>
+#include <string>
+#include <utility>
+
+/****************************************************************
+ * Parsing, straight into NFA fragments.
+ ****************************************************************/
+namespace {
+
+// A piece of NFA with dangling exits, (state, 0 for `out` or 1 for `out1`).
+struct Fragment {
+    int start;
+    std::vector<std::pair<int, int>> exits;
+};
+
+// Bytes that can't start a UTF-8 sequence, matched on their own.
+bool stray_byte(int b) {
+    return (b >= 0x80 && b <= 0xbf) || b == 0xc0 || b == 0xc1 || b >= 0xf5;
+}
+
+/**
+ * A set of characters: single bytes (ASCII, and stray bytes of invalid
+ * UTF-8) and ranges of multibyte codepoints.
+ */
+struct CharClass {
+    std::bitset<256> bytes;
+    std::vector<std::pair<char32_t, char32_t>> ranges;
+
+    void add(char32_t low, char32_t high) {
+        for (char32_t c = low; c <= std::min<char32_t>(high, 0x7f); c++)
+            bytes.set(c);
+        if (high >= 0x80)
+            ranges.emplace_back(std::max<char32_t>(low, 0x80), high);
+    }
+
+    void add(const CharClass &other) {
+        bytes |= other.bytes;
+        ranges.insert(ranges.end(), other.ranges.begin(), other.ranges.end());
+    }
+
+    void negate() {
+        for (int b = 0; b < 256; b++)
+            bytes[b] = !bytes[b] && (b < 0x80 || stray_byte(b));
+
+        std::sort(ranges.begin(), ranges.end());
+        std::vector<std::pair<char32_t, char32_t>> complement;
+        char32_t next = 0x80;
+        for (auto [low, high] : ranges) {
+            if (low > next)
+                complement.emplace_back(next, low - 1);
+            next = std::max<char32_t>(next, high + 1);
+        }
+        if (next <= 0x10ffff)
+            complement.emplace_back(next, 0x10ffff);
+        ranges = std::move(complement);
+    }
+};
+
+/**
+ * Cut codepoints [low, high] into runs whose UTF-8 encodings are a
+ * range of bytes at every position, calling `emit` with the byte
+ * ranges of each.
+ */
+template<typename Emit>
+void utf8_sequences(char32_t low, char32_t high, Emit &emit) {
+    if (low > high)
+        return;
+    // Surrogates aren't encoded.
+    if (low <= 0xdfff && high >= 0xd800) {
+        if (low < 0xd800)
+            utf8_sequences(low, 0xd7ff, emit);
+        if (high > 0xdfff)
+            utf8_sequences(0xe000, high, emit);
+        return;
+    }
+    // Encodings of one length...
+    for (char32_t last : {0x7f, 0x7ff, 0xffff}) {
+        if (low <= last && last < high) {
+            utf8_sequences(low, last, emit);
+            utf8_sequences(last + 1, high, emit);
+            return;
+        }
+    }
+    // ... with all continuation bytes after the first differing one
+    // spanning their full range.
+    for (int i = 1; i < 4; i++) {
+        char32_t mask = (1u << (6 * i)) - 1;
+        if ((low & ~mask) == (high & ~mask))
+            continue;
+        if ((low & mask) != 0) {
+            utf8_sequences(low, low | mask, emit);
+            utf8_sequences((low | mask) + 1, high, emit);
+            return;
+        }
+        if ((high & mask) != mask) {
+            utf8_sequences(low, (high & ~mask) - 1, emit);
+            utf8_sequences(high & ~mask, high, emit);
+            return;
+        }
+    }
+
+    std::string first, last;
+    encode_utf8(low, first);
+    encode_utf8(high, last);
+    std::vector<std::pair<unsigned char, unsigned char>> sequence;
+    for (std::size_t i = 0; i < first.size(); i++)
+        sequence.emplace_back(first[i], last[i]);
+    emit(sequence);
+}
+
+class Parser {
+    Regex &regex;
+    std::string_view pattern;
+    std::size_t pos = 0;
+
+    [[noreturn]] void fail(const char *what) {
+        throw std::invalid_argument(std::string(what) + " at offset " + std::to_string(pos));
+    }
+
+    bool at_end() const { return pos >= pattern.size(); }
+    char peek() const { return pattern[pos]; }
+
+    int add(Regex::State state) {
+        regex.states.push_back(state);
+        return regex.states.size() - 1;
+    }
+
+    int add_set(const std::bitset<256> &set) {
+        regex.sets.push_back(set);
+        return add({Regex::State::Set, -1, -1, (int)regex.sets.size() - 1});
+    }
+
+    void patch(const Fragment &fragment, int target) {
+        for (auto [state, slot] : fragment.exits)
+            (slot ? regex.states[state].out1 : regex.states[state].out) = target;
+    }
+
+    Fragment empty() {
+        int state = add({Regex::State::Split});
+        return {state, {{state, 0}}};
+    }
+
+    // Either of two fragments.
+    Fragment either(Fragment a, const Fragment &b) {
+        int split = add({Regex::State::Split, a.start, b.start});
+        a.start = split;
+        a.exits.insert(a.exits.end(), b.exits.begin(), b.exits.end());
+        return a;
+    }
+
+    // A byte in each of `sets`, one after the other.
+    Fragment chain(const std::vector<std::bitset<256>> &sets) {
+        int start = add_set(sets.front()), last = start;
+        for (std::size_t i = 1; i < sets.size(); i++) {
+            int state = add_set(sets[i]);
+            regex.states[last].out = state;
+            last = state;
+        }
+        return {start, {{last, 0}}};
+    }
+
+    // The bytes of the codepoint starting at `pos`, moving past it.
+    Fragment literal() {
+        std::size_t end = next_codepoint(pattern, pos);
+        std::vector<std::bitset<256>> sets(end - pos);
+        for (std::size_t i = 0; pos < end; i++)
+            sets[i].set((unsigned char)pattern[pos++]);
+        return chain(sets);
+    }
+
+    /**
+     * A character of `set`: a single byte, or the lead byte and
+     * continuation bytes of a multibyte codepoint. Matching stays byte
+     * by byte, but never stops halfway through a codepoint.
+     */
+    Fragment character(const CharClass &set) {
+        std::optional<Fragment> result;
+        if (set.bytes.any() || set.ranges.empty())
+            result = chain({set.bytes});
+        auto emit = [&](const std::vector<std::pair<unsigned char, unsigned char>> &sequence) {
+            std::vector<std::bitset<256>> sets(sequence.size());
+            for (std::size_t i = 0; i < sequence.size(); i++) {
+                for (int b = sequence[i].first; b <= sequence[i].second; b++)
+                    sets[i].set(b);
+            }
+            Fragment fragment = chain(sets);
+            result = result ? either(*result, fragment) : fragment;
+        };
+        for (auto [low, high] : set.ranges)
+            utf8_sequences(low, high, emit);
+        return *result;
+    }
+
+    // The set named by `\c`, for c in dDwWsS.
+    static bool class_escape(char c, CharClass &set) {
+        CharClass result;
+        switch (c) {
+        case 'd': case 'D':
+            result.add('0', '9');
+            break;
+        case 'w': case 'W':
+            for (int i = 0; i < 0x80; i++) {
+                if (std::isalnum(i) || i == '_')
+                    result.add(i, i);
+            }
+            break;
+        case 's': case 'S':
+            for (char space : {' ', '\t', '\n', '\r', '\f', '\v'}) result.add(space, space);
+            break;
+        default:
+            return false;
+        }
+        if (std::isupper(c))
+            result.negate();
+        set.add(result);
+        return true;
+    }
+
+    static char literal_escape(char c) {
+        switch (c) {
+        case 't': return '\t';
+        case 'n': return '\n';
+        case 'r': return '\r';
+        default: return c;
+        }
+    }
+
+    /**
+     * A character of a class, returns false if it was a class escape,
+     * which is added to `set` as is.
+     */
+    bool class_character(CharClass &set, char32_t &c) {
+        if (peek() != '\\') {
+            c = decode_utf8(pattern, pos);
+            return true;
+        }
+        pos++;
+        if (at_end()) fail("trailing \\");
+        if (class_escape(peek(), set)) {
+            pos++;
+            return false;
+        }
+        c = peek() & 0x80 ? decode_utf8(pattern, pos) : literal_escape(pattern[pos++]);
+        return true;
+    }
+
+    CharClass parse_class() {
+        // Past the '['.
+        bool negate = !at_end() && peek() == '^';
+        if (negate) pos++;
+
+        CharClass set;
+        bool first = true;
+        while (true) {
+            if (at_end()) fail("unterminated [");
+            if (peek() == ']' && !first) {
+                pos++;
+                break;
+            }
+            first = false;
+
+            char32_t low, high;
+            if (!class_character(set, low))
+                continue;
+            high = low;
+            if (pos + 1 < pattern.size() && peek() == '-' && pattern[pos + 1] != ']') {
+                pos++;
+                if (!class_character(set, high) || high < low) fail("bad range");
+            }
+            set.add(low, high);
+        }
+        if (negate)
+            set.negate();
+        return set;
+    }
+
+    Fragment parse_atom() {
+        char c = pattern[pos++];
+        CharClass set;
+        switch (c) {
+        case '(': {
+            Fragment inner = parse_alternation();
+            if (at_end() || peek() != ')') fail("missing )");
+            pos++;
+            return inner;
+        }
+        case '[':
+            set = parse_class();
+            break;
+        case '.':
+            set.add('\n', '\n');
+            set.negate();
+            break;
+        case '^': {
+            int state = add({Regex::State::LineStart});
+            return {state, {{state, 0}}};
+        }
+        case '$': {
+            int state = add({Regex::State::LineEnd});
+            return {state, {{state, 0}}};
+        }
+        case '\\':
+            if (at_end()) fail("trailing \\");
+            if (class_escape(peek(), set)) {
+                pos++;
+                break;
+            }
+            if (peek() & 0x80)
+                return literal();
+            c = literal_escape(pattern[pos++]);
+            set.add((unsigned char)c, (unsigned char)c);
+            break;
+        case '*': case '+': case '?':
+            pos--;
+            fail("nothing to repeat");
+        default:
+            pos--;
+            return literal();
+        }
+        return character(set);
+    }
+
+    Fragment parse_repeat() {
+        Fragment atom = parse_atom();
+        while (!at_end()) {
+            char c = peek();
+            if (c != '*' && c != '+' && c != '?') break;
+            pos++;
+
+            int split = add({Regex::State::Split, atom.start});
+            if (c == '?') {
+                atom.exits.push_back({split, 1});
+                atom.start = split;
+            } else {
+                patch(atom, split);
+                // x* enters through the split, x+ through x.
+                atom = {c == '*' ? split : atom.start, {{split, 1}}};
+            }
+        }
+        return atom;
+    }
+
+    Fragment parse_concatenation() {
+        if (at_end() || peek() == '|' || peek() == ')')
+            return empty();
+        Fragment result = parse_repeat();
+        while (!at_end() && peek() != '|' && peek() != ')') {
+            Fragment next = parse_repeat();
+            patch(result, next.start);
+            result.exits = std::move(next.exits);
+        }
+        return result;
+    }
+
+    Fragment parse_alternation() {
+        Fragment result = parse_concatenation();
+        while (!at_end() && peek() == '|') {
+            pos++;
+            result = either(result, parse_concatenation());
+        }
+        return result;
+    }
+
+public:
+    Parser(Regex &regex, std::string_view pattern) : regex{regex}, pattern{pattern} {}
+
+    void parse() {
+        Fragment fragment = parse_alternation();
+        if (!at_end()) fail("unmatched )");
+        patch(fragment, add({Regex::State::Match}));
+        regex.start = fragment.start;
+    }
+};
+
+}
+
+Regex::Regex(std::string_view pattern) {
+    Parser(*this, pattern).parse();
+}
+
+/****************************************************************
+ * Lazy DFA.
+ ****************************************************************/
+RegexMatcher::Dfa::Dfa(const Regex &regex, bool unanchored)
+    : regex{regex}, unanchored{unanchored} {
+    trim();
+}
+
+void RegexMatcher::Dfa::trim() {
+    if (!next.empty() && next.size() < 4096)
+        return;
+    index.clear();
+    nfa_states.clear();
+    flags.clear();
+    next.clear();
+    starts[0] = starts[1] = -1;
+    add({});
+}
+
+/**
+ * Add `state` and everything reachable from it without consuming input
+ * to `out`. Line anchors are passed only where they hold.
+ */
+void RegexMatcher::Dfa::closure(int state, bool line_start, bool line_end,
+                                std::vector<int> &out, std::vector<bool> &seen) const {
+    if (state < 0 || seen[state])
+        return;
+    seen[state] = true;
+
+    const Regex::State &s = regex.states[state];
+    switch (s.kind) {
+    case Regex::State::Split:
+        closure(s.out, line_start, line_end, out, seen);
+        closure(s.out1, line_start, line_end, out, seen);
+        break;
+    case Regex::State::LineStart:
+        if (line_start)
+            closure(s.out, line_start, line_end, out, seen);
+        break;
+    case Regex::State::LineEnd:
+        // Kept, it may still hold once the end of the line is reached.
+        out.push_back(state);
+        if (line_end)
+            closure(s.out, line_start, line_end, out, seen);
+        break;
+    default:
+        out.push_back(state);
+    }
+}
+
+int RegexMatcher::Dfa::add(std::vector<int> &&set) {
+    std::sort(set.begin(), set.end());
+    set.erase(std::unique(set.begin(), set.end()), set.end());
+    auto [it, inserted] = index.emplace(set, nfa_states.size());
+    if (!inserted)
+        return it->second;
+
+    uint8_t flag = 0;
+    std::vector<bool> seen(regex.states.size());
+    std::vector<int> at_end;
+    for (int state : set) {
+        if (regex.states[state].kind == Regex::State::Match)
+            flag |= accepting;
+        closure(state, false, true, at_end, seen);
+    }
+    for (int state : at_end) {
+        if (regex.states[state].kind == Regex::State::Match)
+            flag |= accepting_at_end;
+    }
+
+    nfa_states.push_back(std::move(set));
+    flags.push_back(flag);
+    next.emplace_back();
+    next.back().fill(-1);
+    return it->second;
+}
+
+int RegexMatcher::Dfa::start(bool line_start) {
+    int &cached = starts[line_start];
+    if (cached < 0) {
+        std::vector<int> set;
+        std::vector<bool> seen(regex.states.size());
+        closure(regex.start, line_start, false, set, seen);
+        cached = add(std::move(set));
+    }
+    return cached;
+}
+
+int RegexMatcher::Dfa::compute(int state, unsigned char c) {
+    std::vector<int> set;
+    std::vector<bool> seen(regex.states.size());
+    for (int s : nfa_states[state]) {
+        const Regex::State &nfa = regex.states[s];
+        if (nfa.kind == Regex::State::Set && regex.sets[nfa.set][c])
+            closure(nfa.out, false, false, set, seen);
+    }
+    if (unanchored)
+        closure(regex.start, false, false, set, seen);
+
+    int result = add(std::move(set));
+    next[state][c] = result;
+    return result;
+}
+
+/****************************************************************
+ * Matching.
+ ****************************************************************/
+RegexMatcher::RegexMatcher(const Regex &regex)
+    : anchored{regex, false}, unanchored{regex, true} {}
+
+bool RegexMatcher::search(std::string_view line) {
+    unanchored.trim();
+    int state = unanchored.start(true);
+    for (char c : line) {
+        if (unanchored.is_accepting(state))
+            return true;
+        state = unanchored.step(state, c);
+    }
+    return unanchored.is_accepting(state) || unanchored.is_accepting_at_end(state);
+}
+
+std::ptrdiff_t RegexMatcher::match_at(std::string_view line, std::size_t at) {
+    int state = anchored.start(at == 0);
+    std::ptrdiff_t longest = -1;
+    for (std::size_t i = at; state != Dfa::dead; i++) {
+        if (anchored.is_accepting(state))
+            longest = i - at;
+        if (i == line.size()) {
+            if (anchored.is_accepting_at_end(state))
+                longest = i - at;
+            break;
+        }
+        state = anchored.step(state, line[i]);
+    }
+    return longest;
+}
+
+void RegexMatcher::find_all(std::string_view line, std::size_t line_number,
+                            std::vector<RegexMatch> &matches) {
+    if (!search(line))
+        return;
+
+    // Matches start at codepoints, not halfway through one.
+    auto next = [&](std::size_t at) { return at < line.size() ? next_codepoint(line, at) : at + 1; };
+    anchored.trim();
+    for (std::size_t at = 0; at <= line.size();) {
+        std::ptrdiff_t length = match_at(line, at);
+        if (length < 0) {
+            at = next(at);
+            continue;
+        }
+        matches.push_back({line_number, at, (std::size_t)length});
+        at = length > 0 ? at + length : next(at);
+    }
+}
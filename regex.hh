@@ -0,0 +1,117 @@
+#pragma once
+
+#include <array>
+#include <bitset>
+#include <cstdint>
+#include <map>
+#include <string_view>
+#include <vector>
+
+/**
+ * A regular expression compiled to a Thompson NFA.
+ *
+ * Supports literals, `.`, classes (`[a-z_]`, `[^"]`), the escapes
+ * `\d \w \s` (and `\D \W \S`), grouping, `|`, `*`, `+`, `?` and the
+ * line anchors `^` and `$`. Patterns are matched a line at a time, so
+ * matches never span lines.
+ *
+ * Text is UTF-8: `.`, classes (which may list codepoints, `[é中-龥]`)
+ * and negated escapes consume whole codepoints, compiled into a lead
+ * byte followed by continuation bytes so the DFA stays byte driven.
+ * Bytes that can't start a sequence match `.` on their own.
+ *
+ * Immutable once built, so it can be shared between threads each
+ * matching with their own `RegexMatcher`.
+ */
+class Regex {
+public:
+    struct State {
+        enum Kind : uint8_t {
+            // Consume a character in `sets[set]`, go to `out`.
+            Set,
+            // Go to `out` and `out1` (unless -1) without consuming anything.
+            Split,
+            LineStart,
+            LineEnd,
+            Match
+        } kind;
+        int out = -1, out1 = -1;
+        int set = -1;
+    };
+
+    std::vector<State> states;
+    std::vector<std::bitset<256>> sets;
+    int start = -1;
+
+    // Throws `std::invalid_argument` if the pattern is malformed.
+    explicit Regex(std::string_view pattern);
+};
+
+struct RegexMatch {
+    std::size_t line;
+    std::size_t column;
+    std::size_t length;
+};
+
+/**
+ * Matches lines against a `Regex` through a DFA built lazily from its
+ * NFA, state by state as input calls for them. Not thread safe, give
+ * each thread a matcher of its own.
+ */
+class RegexMatcher {
+    /**
+     * Lazily built DFA. Unanchored ones start a new match at every
+     * position, for telling whether a line matches at all in a single
+     * pass.
+     */
+    class Dfa {
+        const Regex &regex;
+        bool unanchored;
+
+        std::map<std::vector<int>, int> index;
+        std::vector<std::vector<int>> nfa_states;
+        std::vector<uint8_t> flags;
+        // Transitions, -1 if not computed yet.
+        std::vector<std::array<int, 256>> next;
+        int starts[2] = {-1, -1};
+
+        void closure(int state, bool line_start, bool line_end,
+                     std::vector<int> &out, std::vector<bool> &seen) const;
+        int add(std::vector<int> &&set);
+        int compute(int state, unsigned char c);
+    public:
+        static constexpr int dead = 0;
+        static constexpr uint8_t accepting = 1, accepting_at_end = 2;
+
+        Dfa(const Regex &regex, bool unanchored);
+
+        // Drop every computed state once there are too many, between lines.
+        void trim();
+
+        int start(bool line_start);
+        int step(int state, unsigned char c) {
+            int n = next[state][c];
+            return n >= 0 ? n : compute(state, c);
+        }
+        bool is_accepting(int state) const { return flags[state] & accepting; }
+        bool is_accepting_at_end(int state) const { return flags[state] & accepting_at_end; }
+    };
+
+    Dfa anchored;
+    Dfa unanchored;
+public:
+    explicit RegexMatcher(const Regex &regex);
+
+    // Whether `line` contains a match.
+    bool search(std::string_view line);
+
+    // Length of the longest match starting at `at`, or -1 if there is none.
+    std::ptrdiff_t match_at(std::string_view line, std::size_t at);
+
+    /**
+     * Append the leftmost-longest, non-overlapping matches in `line`
+     * (line number `line_number`) to `matches`.
+     */
+    void find_all(std::string_view line, std::size_t line_number,
+                  std::vector<RegexMatch> &matches);
+};
@@ -1,19 +1,157 @@
 #include "rope.hh"
 #include "arena.hh"
+#include "pool.hh"
+#include "simd.hh"
+#include "store.hh"
 
-int RopeNode::calculate_weight() {
-    if (is_parent()) {
-        return left->weight + right->calculate_weight();
-    } else {
-        return weight;
+#include <cmath>
+#include <cstdint>
+#include <future>
+
+/****************************************************************
+ * Measuring text. The vector variants count a byte lane at a time,
+ * summing the lanes up before they can overflow. Bytes start a
+ * codepoint unless they are continuation bytes, i.e. (signed) below
+ * -64.
+ ****************************************************************/
+static TextMetrics measure_scalar(const char *s, std::size_t length) {
+    TextMetrics metrics;
+    for (std::size_t i = 0; i < length; i++) {
+        metrics.newlines += s[i] == '\n';
+        metrics.codepoints += (signed char)s[i] >= -64;
+    }
+    return metrics;
+}
+
+#ifdef HAVE_X86_SIMD
+static TextMetrics measure_sse2(const char *s, std::size_t length) {
+    const __m128i newline = _mm_set1_epi8('\n');
+    const __m128i continuation = _mm_set1_epi8(-65);
+    std::size_t blocks = length / 16;
+    TextMetrics metrics;
+    for (std::size_t block = 0; block < blocks;) {
+        std::size_t run = std::min<std::size_t>(blocks - block, 255);
+        __m128i newlines = _mm_setzero_si128(), starts = _mm_setzero_si128();
+        for (std::size_t end = block + run; block < end; block++) {
+            __m128i bytes = _mm_loadu_si128(reinterpret_cast<const __m128i *>(s + 16 * block));
+            newlines = _mm_sub_epi8(newlines, _mm_cmpeq_epi8(bytes, newline));
+            starts = _mm_sub_epi8(starts, _mm_cmpgt_epi8(bytes, continuation));
+        }
+        __m128i sums = _mm_sad_epu8(newlines, _mm_setzero_si128());
+        metrics.newlines += _mm_extract_epi16(sums, 0) + _mm_extract_epi16(sums, 4);
+        sums = _mm_sad_epu8(starts, _mm_setzero_si128());
+        metrics.codepoints += _mm_extract_epi16(sums, 0) + _mm_extract_epi16(sums, 4);
+    }
+    return metrics + measure_scalar(s + 16 * blocks, length % 16);
+}
+
+__attribute__((target("avx2")))
+static std::size_t sum_lanes_avx2(__m256i lanes) {
+    __m256i sums = _mm256_sad_epu8(lanes, _mm256_setzero_si256());
+    __m128i halves = _mm_add_epi64(_mm256_castsi256_si128(sums), _mm256_extracti128_si256(sums, 1));
+    return _mm_extract_epi16(halves, 0) + _mm_extract_epi16(halves, 4);
+}
+
+__attribute__((target("avx2")))
+static TextMetrics measure_avx2(const char *s, std::size_t length) {
+    const __m256i newline = _mm256_set1_epi8('\n');
+    const __m256i continuation = _mm256_set1_epi8(-65);
+    std::size_t blocks = length / 32;
+    TextMetrics metrics;
+    for (std::size_t block = 0; block < blocks;) {
+        std::size_t run = std::min<std::size_t>(blocks - block, 255);
+        __m256i newlines = _mm256_setzero_si256(), starts = _mm256_setzero_si256();
+        for (std::size_t end = block + run; block < end; block++) {
+            __m256i bytes = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(s + 32 * block));
+            newlines = _mm256_sub_epi8(newlines, _mm256_cmpeq_epi8(bytes, newline));
+            starts = _mm256_sub_epi8(starts, _mm256_cmpgt_epi8(bytes, continuation));
+        }
+        metrics.newlines += sum_lanes_avx2(newlines);
+        metrics.codepoints += sum_lanes_avx2(starts);
+    }
+    return metrics + measure_scalar(s + 32 * blocks, length % 32);
+}
+#endif
+
+using Measure = TextMetrics (*)(const char *, std::size_t);
+
+TextMetrics RopeNode::measure(const char *s, std::size_t length) {
+    static const Measure scan = simd_pick(SIMD_VARIANTS(measure));
+    return scan(s, length);
+}
+
+std::vector<TextMetrics> RopeNode::measure_each(const char *s, std::size_t length) {
+    std::vector<TextMetrics> metrics;
+    for (Measure scan : simd_supported(SIMD_VARIANTS(measure)))
+        metrics.push_back(scan(s, length));
+    return metrics;
+}
+
+// Below this much text counting isn't worth handing to other threads.
+static constexpr std::size_t parallel_count_threshold = 1 << 20;
+
+/**
+ * Metrics of each of `leaves`, measured in parallel on `thread_pool()`
+ * in runs of consecutive leaves.
+ */
+static std::vector<TextMetrics> measure(const std::vector<std::string_view> &leaves) {
+    std::vector<TextMetrics> metrics(leaves.size());
+    auto count = [&](std::size_t first, std::size_t last) {
+        for (std::size_t i = first; i < last; i++)
+            metrics[i] = RopeNode::measure(leaves[i].data(), leaves[i].size());
+    };
+
+    std::size_t total = 0;
+    for (std::string_view leaf : leaves)
+        total += leaf.size();
+    ThreadPool &pool = thread_pool();
+    std::size_t tasks = std::min(leaves.size(), 4 * pool.size());
+    if (total < parallel_count_threshold || tasks <= 1) {
+        count(0, leaves.size());
+        return metrics;
+    }
+
+    std::vector<std::future<void>> done;
+    for (std::size_t task = 0; task < tasks; task++) {
+        std::size_t first = leaves.size() * task / tasks;
+        std::size_t last = leaves.size() * (task + 1) / tasks;
+        done.push_back(pool.submit([=, &count] { count(first, last); }));
+    }
+    for (std::future<void> &task : done)
+        task.get();
+    return metrics;
+}
+
+/**
+ * Join `leaves[first, first + count)` into a perfectly balanced rope,
+ * sibling subtrees differ by at most one leaf.
+ */
+static RopeNode *assemble(const std::vector<RopeNode *> &leaves, std::size_t first, std::size_t count) {
+    if (count == 1)
+        return leaves[first];
+
+    std::size_t half = count / 2;
+    return new RopeNode{assemble(leaves, first, half),
+                        assemble(leaves, first + half, count - half)};
+}
+
+// Cut [string, string + length) into equally long (give or take one) slices of at most `leaf`.
+static std::vector<std::string_view> cut(const char *string, std::size_t length, std::size_t leaf) {
+    std::size_t count = std::max<std::size_t>(1, (length + leaf - 1) / leaf);
+    std::vector<std::string_view> slices;
+    slices.reserve(count);
+    for (std::size_t i = 0; i < count; i++) {
+        std::size_t start = length * i / count;
+        slices.emplace_back(string + start, length * (i + 1) / count - start);
     }
+    return slices;
 }
 
 std::string RopeNode::str(bool accept_parent) const {
     if (is_leaf())
         return std::string{string, weight};
     else if (accept_parent)
-        return left->str() + right->str();
+        return render();
     else
         assert(false);
 }
@@ -24,66 +162,313 @@ void RopeNode::dump(int indent) const {
         std::cout << ": " << this->str();
     std::cout << std::endl;
     if (this->is_parent()) {
-        if (this->left)
-            left->dump(indent + 1);
-        if (this->right)
-            right->dump(indent + 1);
+        left->dump(indent + 1);
+        right->dump(indent + 1);
     }
 }
 
-int RopeNode::reweigh() {
-    if (is_parent()) {
-        weight = left->reweigh();
-        return weight + right->reweigh();
-    } else {
-        return weight;
+int RopeNode::verify() const {
+    if (is_leaf()) {
+        assert(height == 0);
+        assert(length == weight);
+        if (indexed) {
+            TextMetrics counted = measure(string, length);
+            assert(newlines == counted.newlines);
+            assert(codepoints == counted.codepoints);
+        } else {
+            assert(newlines == 0 && codepoints == 0);
+        }
+        return 1;
     }
+
+    assert(left != nullptr && right != nullptr);
+    assert(weight == left->length);
+    assert(length == left->length + right->length);
+    assert(newlines == left->newlines + right->newlines);
+    assert(codepoints == left->codepoints + right->codepoints);
+    assert(indexed == (left->indexed && right->indexed));
+    assert(height == std::max(left->height, right->height) + 1);
+    assert(std::abs(left->height - right->height) <= 1);
+
+    int count = left->verify() + right->verify() + 1;
+    // An AVL tree with n nodes is at most ~1.44 * log2(n + 2) high.
+    assert(height <= 1.45 * std::log2(count + 2));
+    return count;
 }
 
-std::pair<const RopeNode &, int> RopeNode::node_at(int index) const {
-    if (weight <= index && right != nullptr) {
+std::pair<const RopeNode &, std::size_t> RopeNode::node_at(std::size_t index) const {
+    if (is_leaf())
+        return {*this, index};
+    else if (index >= weight)
         return right->node_at(index - weight);
-    } else if (left != nullptr) {
+    else
         return left->node_at(index);
-    } else {
-        return {*this, index};
-    }
 }
 
-char RopeNode::operator[](int index) const {
+char RopeNode::operator[](std::size_t index) const {
     auto [n, i] = node_at(index);
     return n.string[i];
 }
 
-RopeNode *RopeNode::concat(RopeNode *other) {
-    auto *result = new RopeNode{this, other};
-    result->reweigh();
-    return result;
+std::size_t RopeNode::offset_of_line(std::size_t line) const {
+    if (line == 0) {
+        return 0;
+    } else if (line > newlines) {
+        return length;
+    } else if (is_parent()) {
+        if (line <= left->newlines)
+            return left->offset_of_line(line);
+        else
+            return weight + right->offset_of_line(line - left->newlines);
+    } else {
+        const char *p = string;
+        while (true) {
+            p = static_cast<const char *>(std::memchr(p, '\n', string + length - p)) + 1;
+            if (--line == 0) return p - string;
+        }
+    }
 }
 
-RopeNode *RopeNode::insert(const char *string, int index) {
-    auto [left, right] = split(index);
-    if (left == nullptr && right == nullptr)
-        return new RopeNode(string);
-    else if (left == nullptr && right != nullptr)
-        return (new RopeNode(string))->concat(right);
-    else if (left != nullptr && right == nullptr)
-        return left->concat(new RopeNode(string));
+std::size_t RopeNode::line_of_offset(std::size_t index) const {
+    if (index >= length)
+        return newlines;
+    else if (is_leaf())
+        return count_newlines(string, index);
+    else if (index < weight)
+        return left->line_of_offset(index);
+    else
+        return left->newlines + right->line_of_offset(index - weight);
+}
+
+std::size_t RopeNode::codepoint_of_offset(std::size_t index) const {
+    if (index >= length)
+        return codepoints;
+    else if (is_leaf())
+        return measure(string, index).codepoints;
+    else if (index < weight)
+        return left->codepoint_of_offset(index);
+    else
+        return left->codepoints + right->codepoint_of_offset(index - weight);
+}
+
+std::size_t RopeNode::offset_of_codepoint(std::size_t codepoint) const {
+    if (codepoint >= codepoints) {
+        return length;
+    } else if (is_parent()) {
+        if (codepoint < left->codepoints)
+            return left->offset_of_codepoint(codepoint);
+        else
+            return weight + right->offset_of_codepoint(codepoint - left->codepoints);
+    } else {
+        for (std::size_t i = 0;; i++) {
+            if ((signed char)string[i] >= -64 && codepoint-- == 0)
+                return i;
+        }
+    }
+}
+
+std::size_t RopeNode::indexed_length() const {
+    if (indexed)
+        return length;
+    else if (is_leaf())
+        return 0;
+    else if (!left->indexed)
+        return left->indexed_length();
+    else
+        return weight + right->indexed_length();
+}
+
+void RopeNode::unindexed_leaves(std::size_t end, std::vector<std::string_view> &leaves) const {
+    if (indexed || end == 0)
+        return;
+    if (is_leaf()) {
+        leaves.push_back(view());
+        return;
+    }
+    left->unindexed_leaves(end, leaves);
+    if (end > weight)
+        right->unindexed_leaves(end - weight, leaves);
+}
+
+RopeNode *RopeNode::index(std::size_t end, const TextMetrics *&metrics) {
+    if (indexed || end == 0)
+        return this;
+    if (is_leaf())
+        return new RopeNode(string, length, *metrics++);
+
+    RopeNode *lhs = left->index(end, metrics);
+    RopeNode *rhs = end > weight ? right->index(end - weight, metrics) : right;
+    if (lhs == left && rhs == right)
+        return this;
+    return new RopeNode(lhs, rhs);
+}
+
+RopeNode *RopeNode::index(std::size_t end) {
+    std::vector<std::string_view> leaves;
+    unindexed_leaves(end, leaves);
+    if (leaves.empty())
+        return this;
+
+    std::vector<TextMetrics> metrics = ::measure(leaves);
+    const TextMetrics *next = metrics.data();
+    return index(end, next);
+}
+
+RopeNode *RopeNode::refine(std::size_t index) {
+    if (is_leaf()) {
+        if (!indexed || length <= max_leaf)
+            return this;
+        std::vector<RopeNode *> leaves;
+        for (std::string_view slice : cut(string, length, max_leaf))
+            leaves.push_back(new RopeNode{slice.data(), slice.size(), measure(slice.data(), slice.size())});
+        return assemble(leaves, 0, leaves.size());
+    } else if (index < weight) {
+        RopeNode *lhs = left->refine(index);
+        return lhs == left ? this : join(lhs, right);
+    } else {
+        RopeNode *rhs = right->refine(index - weight);
+        return rhs == right ? this : join(left, rhs);
+    }
+}
+
+std::size_t RopeNode::line_length(std::size_t line) const {
+    std::size_t start = offset_of_line(line);
+    if (line < newlines)
+        return offset_of_line(line + 1) - 1 - start;
+    else
+        return length - start;
+}
+
+/**
+ * Join two AVL balanced ropes whose heights differ by at most two,
+ * rotating once or twice if needed.
+ */
+RopeNode *RopeNode::balance(RopeNode *lhs, RopeNode *rhs) {
+    if (lhs->height > rhs->height + 1) {
+        if (lhs->left->height >= lhs->right->height) {
+            return new RopeNode(lhs->left, new RopeNode(lhs->right, rhs));
+        } else {
+            RopeNode *pivot = lhs->right;
+            return new RopeNode(new RopeNode(lhs->left, pivot->left),
+                                new RopeNode(pivot->right, rhs));
+        }
+    } else if (rhs->height > lhs->height + 1) {
+        if (rhs->right->height >= rhs->left->height) {
+            return new RopeNode(new RopeNode(lhs, rhs->left), rhs->right);
+        } else {
+            RopeNode *pivot = rhs->left;
+            return new RopeNode(new RopeNode(lhs, pivot->left),
+                                new RopeNode(pivot->right, rhs->right));
+        }
+    } else {
+        return new RopeNode(lhs, rhs);
+    }
+}
+
+RopeNode *RopeNode::join(RopeNode *lhs, RopeNode *rhs) {
+    if (lhs == nullptr || lhs->length == 0)
+        return rhs;
+    if (rhs == nullptr || rhs->length == 0)
+        return lhs;
+
+    // Descend along the inner spine of the taller rope until the
+    // heights match, then rebalance on the way back up.
+    if (lhs->height > rhs->height + 1)
+        return balance(lhs->left, join(lhs->right, rhs));
+    else if (rhs->height > lhs->height + 1)
+        return balance(join(lhs, rhs->left), rhs->right);
     else
-        return left->concat((new RopeNode(string))->concat(right));
+        return new RopeNode(lhs, rhs);
+}
+
+std::pair<RopeNode *, RopeNode *> RopeNode::split(std::size_t index) {
+    if (is_leaf()) {
+        if (index == 0)
+            return {nullptr, length > 0 ? this : nullptr};
+        else if (index >= length)
+            return {this, nullptr};
+        else if (!indexed)
+            return {new RopeNode(string, index, Unindexed{}),
+                    new RopeNode(&string[index], length - index, Unindexed{})};
+        else if (index < length / 2) {
+            // Only measure the shorter half.
+            TextMetrics lhs_metrics = measure(string, index);
+            return {new RopeNode(string, index, lhs_metrics),
+                    new RopeNode(&string[index], length - index, metrics() - lhs_metrics)};
+        } else {
+            TextMetrics rhs_metrics = measure(&string[index], length - index);
+            return {new RopeNode(string, index, metrics() - rhs_metrics),
+                    new RopeNode(&string[index], length - index, rhs_metrics)};
+        }
+    } else if (index < weight) {
+        auto [lhs, rhs] = left->split(index);
+        return {lhs, join(rhs, right)};
+    } else if (index > weight) {
+        auto [lhs, rhs] = right->split(index - weight);
+        return {join(left, lhs), rhs};
+    } else {
+        return {left, right};
+    }
+}
+
+RopeNode *RopeNode::insert(const char *string, std::size_t index) {
+    return insert(string, std::strlen(string), index);
+}
+
+RopeNode *RopeNode::insert(const char *string, std::size_t length, std::size_t index) {
+    auto [left, right] = split(index);
+    return join(join(left, make_rope(string, length)), right);
+}
+
+RopeNode *RopeNode::extend(std::size_t index, const char *string, std::size_t length) {
+    if (is_leaf()) {
+        if (index != this->length || this->string + this->length != string ||
+            this->length + length > max_leaf || !indexed)
+            return nullptr;
+        return new RopeNode(this->string, this->length + length,
+                            metrics() + measure(string, length));
+    } else if (index <= weight) {
+        RopeNode *lhs = left->extend(index, string, length);
+        return lhs != nullptr ? new RopeNode(lhs, right) : nullptr;
+    } else {
+        RopeNode *rhs = right->extend(index - weight, string, length);
+        return rhs != nullptr ? new RopeNode(left, rhs) : nullptr;
+    }
+}
+
+RopeNode *RopeNode::coalesce(std::size_t index, TextStore &store) {
+    if (index == 0 || index >= length)
+        return this;
+
+    auto [lhs, lhs_index] = node_at(index - 1);
+    auto [rhs, rhs_index] = node_at(index);
+    if (&lhs == &rhs || !lhs.indexed || !rhs.indexed)
+        return this;
+
+    std::size_t merged_length = lhs.length + rhs.length;
+    if (std::min(lhs.length, rhs.length) >= min_leaf || merged_length > max_leaf)
+        return this;
+
+    const char *text = lhs.string;
+    if (lhs.string + lhs.length != rhs.string) {
+        char *copy = store.allocate(merged_length);
+        std::memcpy(copy, lhs.string, lhs.length);
+        std::memcpy(copy + lhs.length, rhs.string, rhs.length);
+        text = copy;
+    }
+    auto *merged = new RopeNode(text, merged_length, lhs.metrics() + rhs.metrics());
+
+    std::size_t start = index - lhs.length;
+    auto [before, rest] = split(start);
+    RopeNode *after = rest->split(merged_length).second;
+    return join(join(before, merged), after);
 }
 
-RopeNode *RopeNode::kill(int start, int length) {
+RopeNode *RopeNode::kill(std::size_t start, std::size_t length) {
     RopeNode *left = split(start).first;
     RopeNode *right = split(start + length).second;
-    if (left == nullptr && right == nullptr)
-        return new RopeNode("");
-    else if (left == nullptr && right != nullptr)
-        return right;
-    else if (left != nullptr && right == nullptr)
-        return left;
-    else
-        return left->concat(right);
+    RopeNode *result = join(left, right);
+    return result != nullptr ? result : new RopeNode("");
 }
 
 
@@ -103,10 +488,122 @@ RopeLeafIterator RopeNode::end_leaf() {
     return RopeLeafIterator();
 }
 
-// template class Arena<RopeNode>;
-// Arena<RopeNode>* Arena<RopeNode>::current = nullptr;
+std::size_t RopeNode::render(char *out, std::size_t start, std::size_t length) const {
+    std::size_t copied = 0;
+    for (RopeCursor cursor(this, start); copied < length && !cursor.at_end(); cursor.next_chunk()) {
+        auto chunk = cursor.chunk().substr(0, length - copied);
+        std::memcpy(out + copied, chunk.data(), chunk.size());
+        copied += chunk.size();
+    }
+    return copied;
+}
+
+std::size_t RopeNode::render(std::vector<iovec> &iov, std::size_t start, std::size_t length) const {
+    std::size_t covered = 0;
+    for (RopeCursor cursor(this, start); covered < length && !cursor.at_end(); cursor.next_chunk()) {
+        auto chunk = cursor.chunk().substr(0, length - covered);
+        if (chunk.empty())
+            continue;
+        iov.push_back({const_cast<char *>(chunk.data()), chunk.size()});
+        covered += chunk.size();
+    }
+    return covered;
+}
+
+std::string RopeNode::render(std::size_t start, std::size_t length) const {
+    std::string result(std::min(length, this->length - std::min(start, this->length)), '\0');
+    render(result.data(), start, result.size());
+    return result;
+}
+
+RopeCursor::RopeCursor(const RopeNode *root, std::size_t offset) : depth{0} {
+    path[depth++] = root;
+    seek(offset);
+}
+
+/**
+ * Push the path from `node` down to its leftmost (or rightmost) leaf.
+ */
+void RopeCursor::descend(const RopeNode *node, bool leftmost) {
+    while (true) {
+        assert(depth < max_rope_depth);
+        path[depth++] = node;
+        if (node->is_leaf())
+            break;
+        node = leftmost ? node->left : node->right;
+    }
+}
+
+void RopeCursor::seek(std::size_t offset) {
+    depth = 1;
+    leaf_start = 0;
+    offset = std::min(offset, path[0]->length);
+
+    const RopeNode *node = path[0];
+    while (node->is_parent()) {
+        // NOTE: An offset at the very end ends up in the last leaf.
+        if (offset - leaf_start >= node->weight) {
+            leaf_start += node->weight;
+            node = node->right;
+        } else {
+            node = node->left;
+        }
+        path[depth++] = node;
+    }
+    index = offset - leaf_start;
+}
+
+bool RopeCursor::next_chunk() {
+    for (int i = depth - 2; i >= 0; i--) {
+        if (path[i + 1] == path[i]->left) {
+            leaf_start += leaf().length;
+            depth = i + 1;
+            descend(path[i]->right, true);
+            index = 0;
+            return true;
+        }
+    }
+    index = leaf().length;
+    return false;
+}
+
+bool RopeCursor::prev_chunk() {
+    for (int i = depth - 2; i >= 0; i--) {
+        if (path[i + 1] == path[i]->right) {
+            depth = i + 1;
+            descend(path[i]->left, false);
+            leaf_start -= leaf().length;
+            index = 0;
+            return true;
+        }
+    }
+    return false;
+}
+
 void *RopeNode::operator new(std::size_t) {
     return Arena<RopeNode>::current->alloc();
 }
 
-RopeNode *make_rope(const char *string) { return new RopeNode{string}; }
+void RopeNode::operator delete(void *node) {
+    Arena<RopeNode>::current->release(static_cast<RopeNode *>(node));
+}
+
+RopeNode *make_rope(const char *string) { return make_rope(string, std::strlen(string)); }
+
+RopeNode *make_rope(const char *string, std::size_t length) {
+    std::vector<std::string_view> slices = cut(string, length, RopeNode::max_leaf);
+    std::vector<TextMetrics> metrics = measure(slices);
+
+    std::vector<RopeNode *> leaves;
+    leaves.reserve(slices.size());
+    for (std::size_t i = 0; i < slices.size(); i++)
+        leaves.push_back(new RopeNode{slices[i].data(), slices[i].size(), metrics[i]});
+    return assemble(leaves, 0, leaves.size());
+}
+
+RopeNode *make_lazy_rope(const char *string, std::size_t length) {
+    std::vector<RopeNode *> leaves;
+    for (std::string_view slice : cut(string, length, RopeNode::lazy_leaf))
+        leaves.push_back(new RopeNode{slice.data(), slice.size(), RopeNode::Unindexed{}});
+    return assemble(leaves, 0, leaves.size());
+}
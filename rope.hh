@@ -1,116 +1,259 @@
 #pragma once
 
+#include <algorithm>
 #include <cassert>
+#include <cstdlib>
 #include <cstring>
 #include <iostream>
-#include <sstream>
-#include <stack>
 #include <string>
 #include <string_view>
 #include <utility>
 #include <vector>
+#include <sys/uio.h>
 
 class RopeLeafIterator;
 class RopeCharIterator;
+class TextStore;
+
+/**
+ * What a piece of text is measured in besides its length.
+ */
+struct TextMetrics {
+    std::size_t newlines = 0;
+    // Bytes starting a codepoint, see utf8.hh.
+    std::size_t codepoints = 0;
+
+    TextMetrics operator+(const TextMetrics &other) const {
+        return {newlines + other.newlines, codepoints + other.codepoints};
+    }
+    TextMetrics operator-(const TextMetrics &other) const {
+        return {newlines - other.newlines, codepoints - other.codepoints};
+    }
+};
 
 class RopeNode {
 private:
     // NOTE: Not nessecarily null terminated (but of length `weight`):
     const char *string;
 
-    int calculate_weight();
+    static RopeNode *balance(RopeNode *lhs, RopeNode *rhs);
+
+    // The two passes of `index()`: gather the leaves to count, then
+    // rebuild their paths with the counts (consumed in order).
+    void unindexed_leaves(std::size_t end, std::vector<std::string_view> &leaves) const;
+    RopeNode *index(std::size_t end, const TextMetrics *&metrics);
 public:
+    // Leaf: length of `string`. Parent: total length of the left subtree.
     std::size_t weight;
+    // Total length of the subtree rooted at this node.
+    std::size_t length;
+    // Number of newlines in the subtree rooted at this node.
+    std::size_t newlines;
+    // Number of codepoints in the subtree rooted at this node.
+    std::size_t codepoints;
+    // Leaves are at height 0, parents one above their tallest child.
+    int height;
+    // False if the subtree has leaves that are not measured yet (they
+    // count as empty but for their length), see `make_lazy_rope()`.
+    bool indexed;
     RopeNode *left;
     RopeNode *right;
 
+    // Leaf size policy: ropes built from long strings are chunked into
+    // leaves of at most `max_leaf` characters, and edits merge leaves
+    // shorter than `min_leaf` into their neighbours (see `coalesce()`).
+    static inline std::size_t min_leaf = 512;
+    static inline std::size_t max_leaf = 8192;
+    // Leaf size of lazily indexed ropes, large to keep them small.
+    // Indexing keeps it, only leaves that get worked in are cut down
+    // to `max_leaf` (see `refine()`).
+    static inline std::size_t lazy_leaf = 1 << 18;
+
+    struct Unindexed {};
+
     // Leaf constructor (null terminated string).
-    RopeNode(const char *s)
-        : weight{std::strlen(s)}, string{s}, left{nullptr}, right{nullptr} {}
+    RopeNode(const char *s) : RopeNode(s, std::strlen(s)) {}
     // Leaf constructor (not null terminated).
     RopeNode(const char *s, std::size_t length)
-        : weight{length}, string{s}, left{nullptr}, right{nullptr} {}
-
-    // Parent constructor.
+        : RopeNode(s, length, measure(s, length)) {}
+    // Leaf constructor (not null terminated, already measured).
+    RopeNode(const char *s, std::size_t length, TextMetrics metrics)
+        : string{s}, weight{length}, length{length}, newlines{metrics.newlines},
+          codepoints{metrics.codepoints}, height{0}, indexed{true}, left{nullptr}, right{nullptr} {}
+    // Leaf constructor (not null terminated, measured by `index()`).
+    RopeNode(const char *s, std::size_t length, Unindexed)
+        : string{s}, weight{length}, length{length}, newlines{0},
+          codepoints{0}, height{0}, indexed{false}, left{nullptr}, right{nullptr} {}
+
+    // Parent constructor, the children must be AVL balanced w.r.t. each other.
     RopeNode(RopeNode *lhs, RopeNode *rhs)
-        : weight{lhs->weight}, string{nullptr}, left{lhs}, right{rhs} {}
+        : string{nullptr}, weight{lhs->length}, length{lhs->length + rhs->length},
+          newlines{lhs->newlines + rhs->newlines},
+          codepoints{lhs->codepoints + rhs->codepoints},
+          height{std::max(lhs->height, rhs->height) + 1},
+          indexed{lhs->indexed && rhs->indexed}, left{lhs}, right{rhs} {
+        assert(std::abs(lhs->height - rhs->height) <= 1);
+    }
+
+    /**
+     * Count newlines and codepoints in one vectorized (AVX2 or SSE2,
+     * picked at run time) pass.
+     */
+    static TextMetrics measure(const char *s, std::size_t length);
+
+    /**
+     * `measure()` by each variant the CPU supports, scalar first, for
+     * checking them against each other.
+     */
+    static std::vector<TextMetrics> measure_each(const char *s, std::size_t length);
 
+    static std::size_t count_newlines(const char *s, std::size_t length) {
+        return measure(s, length).newlines;
+    }
 
+    TextMetrics metrics() const { return {newlines, codepoints}; }
 
     bool is_leaf() const { return string != nullptr; }
     bool is_parent() const { return !is_leaf(); }
 
+    std::string_view view() const {
+        assert(is_leaf());
+        return {string, weight};
+    }
+
     std::string str(bool accept_parent = false) const;
 
     void dump(int indent = 0) const;
 
-    int reweigh();
-
-    std::pair<const RopeNode &, int> node_at(int index) const;
-    char operator[](int index) const;
-
-    RopeNode *concat(RopeNode *other);
-
-
-    std::pair<RopeNode *, RopeNode *> split0(RopeNode *orphan, int index) {
-        if (index == weight) {
-            return is_leaf()
-                ? std::make_pair(this, nullptr)
-                : std::make_pair(left, right);
-        } else if (index > weight) {
-            auto [new_right, new_orphan] = right->split0(orphan, index - weight);
-            return std::make_pair(left->concat(new_right), new_orphan);
-        } else {
-            if (is_parent()) {
-                auto [new_left, new_orphan] = left->split0(orphan, index);
-                return std::make_pair(new_left, new_orphan->concat(right));
-            } else {
-                RopeNode *left = index > 0 ? new RopeNode(string, index) : nullptr;
-                RopeNode *right = new RopeNode(&string[index], weight - index);
-                return std::make_pair(left, right);
-            }
-        }
-    }
+    std::pair<const RopeNode &, std::size_t> node_at(std::size_t index) const;
+    char operator[](std::size_t index) const;
+
+    /**
+     * Number of lines, i.e. one more than the number of newlines.
+     */
+    std::size_t line_count() const { return newlines + 1; }
+
+    /**
+     * Offset of the first character on the given (zero indexed) line,
+     * or `length` if there is no such line.
+     */
+    std::size_t offset_of_line(std::size_t line) const;
+
+    /**
+     * Line containing the character at the given offset, i.e. the
+     * number of newlines preceding it.
+     */
+    std::size_t line_of_offset(std::size_t index) const;
+
+    /**
+     * Length of the given line, excluding the terminating newline.
+     */
+    std::size_t line_length(std::size_t line) const;
+
+    /**
+     * Number of codepoints starting before the given offset.
+     */
+    std::size_t codepoint_of_offset(std::size_t index) const;
+
+    /**
+     * Offset of the given (zero indexed) codepoint, or `length` if there
+     * is no such codepoint.
+     */
+    std::size_t offset_of_codepoint(std::size_t codepoint) const;
+
+    /**
+     * Length of the prefix made up of indexed leaves. Line queries are
+     * only meaningful within it.
+     */
+    std::size_t indexed_length() const;
+
+    /**
+     * Measure every unindexed leaf starting before `end`, copying their
+     * paths. Ropes are only ever indexed front to back, so the indexed
+     * leaves form a prefix. Measuring is spread over `thread_pool()` if
+     * there is a lot to count.
+     */
+    RopeNode *index(std::size_t end);
+
+    /**
+     * Cut the indexed leaf containing `index` into `max_leaf` sized
+     * leaves if it is longer, e.g. a `lazy_leaf` about to be edited.
+     * Copies its path, returns this if there is nothing to cut.
+     */
+    RopeNode *refine(std::size_t index);
+
+    /**
+     * Join two (possibly null) ropes into a balanced rope in
+     * O(|lhs->height - rhs->height|) allocations.
+     */
+    static RopeNode *join(RopeNode *lhs, RopeNode *rhs);
+
+    RopeNode *concat(RopeNode *other) { return join(this, other); }
 
     /**
      * Split a rope at the given index, returning a pair of ropes
-     * representing the right- and left-hand-side after the split.
+     * representing the left- and right-hand-side after the split.
+     * Either side is null if empty.
      */
-    std::pair<RopeNode *, RopeNode *> split(int index) {
-        return this->split0(nullptr, index);
-    }
+    std::pair<RopeNode *, RopeNode *> split(std::size_t index);
 
     /**
      * Insert the given string into the rope at the given index.
      */
-    RopeNode *insert(const char *string, int index);
+    RopeNode *insert(const char *string, std::size_t index);
+    RopeNode *insert(const char *string, std::size_t length, std::size_t index);
 
-    RopeNode *kill(int start, int length);
+    /**
+     * Grow the leaf ending at `index` by the given string, which must
+     * directly follow the leaf's characters in memory. Returns null if
+     * there is no such leaf. Copies a single path, no rebalancing.
+     */
+    RopeNode *extend(std::size_t index, const char *string, std::size_t length);
 
-    void render0(std::stringstream &ss) {
-        if (is_leaf()) {
-            ss << std::string_view(string, weight);
-        } else {
-            if (left)
-                left->render0(ss);
-            if (right)
-                right->render0(ss);
-        }
-    }
+    /**
+     * Merge the two leaves meeting at `index` if either is shorter than
+     * `min_leaf` and the result fits in `max_leaf`, copying their text
+     * into `store` unless it is already contiguous.
+     */
+    RopeNode *coalesce(std::size_t index, TextStore &store);
 
-    const std::string render() {
-        std::stringstream ss;
-        render0(ss);
-        return ss.str();
-    }
+    /**
+     * Remove `length` characters starting at `start`.
+     */
+    RopeNode *kill(std::size_t start, std::size_t length);
+
+    /**
+     * Copy `length` characters starting at `start` into `out`, returns
+     * the number of characters copied (less at the end of the rope).
+     */
+    std::size_t render(char *out, std::size_t start, std::size_t length) const;
+
+    /**
+     * Append the leaf slices making up the given range to `iov`, e.g.
+     * for `writev()`, without copying. Returns the number of
+     * characters covered.
+     */
+    std::size_t render(std::vector<iovec> &iov, std::size_t start, std::size_t length) const;
 
-    int node_count() {
+    std::string render(std::size_t start, std::size_t length) const;
+    std::string render() const { return render(0, length); }
+
+    int node_count() const {
         if (is_leaf())
             return 1;
         else
             return left->node_count() + right->node_count() + 1;
     }
 
+    int depth() const { return height; }
+
+    /**
+     * Check the structural invariants of the entire rope (weights,
+     * lengths, heights and AVL balance), returning the number of nodes.
+     * Intended for assertions, O(n).
+     */
+    int verify() const;
+
     RopeCharIterator begin();
     RopeCharIterator end();
 
@@ -118,12 +261,17 @@ public:
     RopeLeafIterator end_leaf();
 
     void *operator new(std::size_t);
-    void operator delete(void*) {}
+    void operator delete(void*);
 };
 
+// Upper bound on the height of any rope (AVL trees with 2^64 nodes
+// are less than 93 high), so paths fit on fixed-size stacks.
+constexpr int max_rope_depth = 96;
+
 class RopeLeafIterator {
 private:
-    std::stack<RopeNode *> stack;
+    RopeNode *stack[max_rope_depth];
+    int size;
     RopeNode *next;
 public:
     using difference_type = int;
@@ -131,29 +279,22 @@ public:
     using pointer = RopeNode *;
     using reference = RopeNode &;
 
-    RopeLeafIterator(RopeNode *root = nullptr) {
-        stack.push(root);
+    RopeLeafIterator(RopeNode *root = nullptr) : size{0} {
+        if (root != nullptr)
+            stack[size++] = root;
         next = next_leaf();
     }
 
     RopeNode *next_leaf() {
-        while (!stack.empty()) {
-            RopeNode *top = stack.top();
-            stack.pop();
-            if (top == nullptr) {
-                return nullptr;
-            }
-
+        while (size > 0) {
+            RopeNode *top = stack[--size];
             if (top->is_leaf()) {
                 return top;
             }
 
-            if (top->right != nullptr) {
-                stack.push(top->right);
-            }
-            if (top->left != nullptr) {
-                stack.push(top->left);
-            }
+            assert(size + 2 <= max_rope_depth);
+            stack[size++] = top->right;
+            stack[size++] = top->left;
         }
 
         return nullptr;
@@ -170,7 +311,7 @@ public:
         return result;
     }
 
-    bool operator!=(RopeLeafIterator &other) { return next != other.next; }
+    bool operator!=(const RopeLeafIterator &other) const { return next != other.next; }
 
     RopeNode &operator*() { return *next; }
 };
@@ -178,7 +319,17 @@ public:
 class RopeCharIterator {
 private:
     RopeLeafIterator leaf_iter;
-    int index;
+    std::string_view chunk;
+    std::size_t index;
+
+    void skip_empty() {
+        static const RopeLeafIterator end;
+        while (index >= chunk.size() && leaf_iter != end) {
+            index = 0;
+            ++leaf_iter;
+            chunk = leaf_iter != end ? (*leaf_iter).view() : std::string_view{};
+        }
+    }
 public:
     using difference_type = int;
     using value_type = char;
@@ -186,20 +337,17 @@ public:
     using reference = char &;
 
     RopeCharIterator(RopeLeafIterator leaf_iter)
-        : leaf_iter{leaf_iter}, index{0} { }
+        : leaf_iter{leaf_iter}, chunk{(*this->leaf_iter).view()}, index{0} {
+        skip_empty();
+    }
 
     RopeCharIterator()
         : leaf_iter{RopeLeafIterator(nullptr)}, index{0} {}
 
     RopeCharIterator &operator++() {
         index++;
-        if (index < (*leaf_iter).weight) {
-            return *this;
-        } else {
-            index = 0;
-            ++leaf_iter;
-            return *this;
-        }
+        skip_empty();
+        return *this;
     }
 
     RopeCharIterator operator++(int) {
@@ -208,12 +356,86 @@ public:
         return result;
     }
 
-    bool operator!=(RopeCharIterator &other) {
+    bool operator!=(const RopeCharIterator &other) const {
         return leaf_iter != other.leaf_iter ||
             index != other.index;
     }
 
-    char operator*() { return (*leaf_iter).str()[index]; }
+    char operator*() const { return chunk[index]; }
+};
+
+/**
+ * Position in a rope that streams the contents one chunk (the rest of
+ * a leaf) or character at a time without allocating. The path from the
+ * root to the current leaf is kept on a fixed-size stack.
+ */
+class RopeCursor {
+private:
+    const RopeNode *path[max_rope_depth];
+    // The current leaf is `path[depth - 1]`.
+    int depth;
+    // Offset of the current leaf in the rope, and of the cursor in the leaf.
+    std::size_t leaf_start;
+    std::size_t index;
+
+    const RopeNode &leaf() const { return *path[depth - 1]; }
+    void descend(const RopeNode *node, bool leftmost);
+public:
+    RopeCursor(const RopeNode *root, std::size_t offset = 0);
+
+    /**
+     * Move to the given offset in O(log n), offsets past the end are
+     * clamped to the end.
+     */
+    void seek(std::size_t offset);
+
+    std::size_t offset() const { return leaf_start + index; }
+    bool at_end() const { return offset() >= path[0]->length; }
+
+    /**
+     * The contents from the cursor to the end of the current leaf.
+     */
+    std::string_view chunk() const { return leaf().view().substr(index); }
+
+    /**
+     * The entire current leaf, which starts at `leaf_offset()`.
+     */
+    std::string_view leaf_view() const { return leaf().view(); }
+    std::size_t leaf_offset() const { return leaf_start; }
+
+    /**
+     * Move to the start of the next leaf, returns false (and moves to
+     * the end) if this is the last leaf.
+     */
+    bool next_chunk();
+
+    /**
+     * Move to the start of the previous leaf, returns false (and stays
+     * put) if this is the first leaf.
+     */
+    bool prev_chunk();
+
+    char operator*() const { return leaf().view()[index]; }
+
+    RopeCursor &operator++() {
+        if (++index >= leaf().length)
+            next_chunk();
+        return *this;
+    }
 };
 
 RopeNode *make_rope(const char *string);
+
+/**
+ * Build a perfectly balanced rope of `max_leaf` sized leaves in O(n).
+ * The leaves are measured up front, in parallel for long strings, the
+ * tree is then assembled from the leaves up.
+ */
+RopeNode *make_rope(const char *string, std::size_t length);
+
+/**
+ * Build a rope over `length` characters without reading them: the
+ * leaves are `lazy_leaf` long and left for `RopeNode::index()` to
+ * measure on first use.
+ */
+RopeNode *make_lazy_rope(const char *string, std::size_t length);
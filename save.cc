@@ -0,0 +1,70 @@
+#include "save.hh"
+
+#include <algorithm>
+#include <cstdio>
+#include <system_error>
+#include <vector>
+
+#include "gc.hh"
+
+static std::string format_size(double bytes) {
+    static const char *units[] = {"B", "KB", "MB", "GB", "TB"};
+    int unit = 0;
+    while (bytes >= 1024 && unit < 4) {
+        bytes /= 1024;
+        unit++;
+    }
+    char buf[32];
+    std::snprintf(buf, sizeof(buf), unit == 0 ? "%.0f %s" : "%.1f %s", bytes, units[unit]);
+    return buf;
+}
+
+std::string describe_save(const std::string &path, const SaveStats &stats) {
+    char buf[128];
+    std::snprintf(buf, sizeof(buf), " in %.3f s (%s/s), durable after %.3f s",
+                  stats.write_seconds,
+                  format_size(stats.bytes / std::max(stats.write_seconds, 1e-9)).c_str(),
+                  stats.durable_seconds);
+    return "Wrote " + format_size(stats.bytes) + " to " + path + buf;
+}
+
+void BackgroundSave::start(RopeNode *root, std::string path) {
+    snapshot = root;
+    this->path = std::move(path);
+    rope_collector().add_root(&snapshot);
+    rope_collector().pin();
+
+    finished.store(false, std::memory_order_relaxed);
+    thread = std::thread(&BackgroundSave::run, this);
+}
+
+void BackgroundSave::run() {
+    try {
+        std::vector<iovec> leaves;
+        snapshot->render(leaves, 0, snapshot->length);
+        report = describe_save(path, save_file(path, leaves));
+    } catch (const std::system_error &e) {
+        report = std::string("Saving failed: ") + e.what();
+    }
+    finished.store(true, std::memory_order_release);
+}
+
+std::optional<std::string> BackgroundSave::poll() {
+    if (!running() || !finished.load(std::memory_order_acquire))
+        return std::nullopt;
+
+    thread.join();
+    rope_collector().unpin();
+    rope_collector().remove_root(&snapshot);
+    snapshot = nullptr;
+    return std::move(report);
+}
+
+BackgroundSave::~BackgroundSave() {
+    if (running()) {
+        // NOTE: Let the save complete rather than leave a temporary file behind.
+        thread.join();
+        rope_collector().unpin();
+        rope_collector().remove_root(&snapshot);
+    }
+}
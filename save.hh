@@ -0,0 +1,50 @@
+#pragma once
+
+#include <atomic>
+#include <optional>
+#include <string>
+#include <thread>
+
+#include "file.hh"
+#include "rope.hh"
+
+/**
+ * Status line report of a finished save: size, throughput and how long
+ * until it was on disk.
+ */
+std::string describe_save(const std::string &path, const SaveStats &stats);
+
+/**
+ * Saves a rope snapshot on a thread of its own, so editing can go on
+ * while a large file is written out.
+ *
+ * Like `HighlightWorker`, the snapshot is a collector root and keeps
+ * the collector pinned until the save is done.
+ */
+class BackgroundSave {
+    std::thread thread;
+    std::atomic<bool> finished{false};
+
+    // Registered and pinned with the collector while saving.
+    RopeNode *snapshot = nullptr;
+    std::string path;
+
+    // Written by the thread before setting `finished`.
+    std::string report;
+
+    void run();
+public:
+    BackgroundSave() = default;
+    BackgroundSave(const BackgroundSave&) = delete;
+    BackgroundSave& operator=(const BackgroundSave&) = delete;
+    ~BackgroundSave();
+
+    bool running() const { return thread.joinable(); }
+
+    void start(RopeNode *root, std::string path);
+
+    /**
+     * The report for the status line, once the save has finished.
+     */
+    std::optional<std::string> poll();
+};
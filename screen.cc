@@ -0,0 +1,113 @@
+#include "screen.hh"
+#include "term.hh"
+#include "utf8.hh"
+
+#include <algorithm>
+#include <string>
+
+// Unchanged cells worth re-sending to avoid another cursor move.
+static constexpr int max_gap = 4;
+
+static std::string_view sgr(Face face) {
+    switch (face) {
+    case Face::Default: return "\e[0m";
+    case Face::Keyword: return "\e[0;32m";
+    case Face::Comment: return "\e[0;37;1m";
+    case Face::Type: return "\e[0;34m";
+    case Face::Preprocessor: return "\e[0;34;1m";
+    }
+    return "\e[0m";
+}
+
+void Screen::resize(int rows, int cols) {
+    _rows = rows;
+    _cols = cols;
+    front.assign(rows * cols, Cell{});
+    back.assign(rows * cols, Cell{});
+    ::clear(ClearOpt::Screen);
+}
+
+void Screen::clear(int row, int col0, int col1) {
+    col1 = std::min(col1, _cols);
+    for (int col = col0; col < col1; col++)
+        at(row, col) = Cell{};
+}
+
+int Screen::put(int row, int col, std::string_view s, Face face, int max_col) {
+    max_col = std::min(max_col, _cols);
+    for (std::size_t i = 0; i < s.size() && col < max_col;) {
+        char32_t c = decode_utf8(s, i);
+        int width = codepoint_width(c);
+        // NOTE: Combining marks are dropped rather than merged into cells.
+        if (width == 0) continue;
+        if (col + width > max_col) break;
+        // NOTE: Anything that would move the terminal cursor is shown as
+        // a blank, keeping one codepoint per cell.
+        if (c < 0x20 || (c >= 0x7f && c < 0xa0))
+            c = ' ';
+        at(row, col++) = Cell{c, face};
+        if (width == 2)
+            at(row, col++) = Cell{Cell::wide_tail, face};
+    }
+    return col;
+}
+
+bool Screen::present() {
+    bool changed = false;
+    Face face = Face::Default;
+    std::string encoded;
+
+    for (int row = 0; row < _rows; row++) {
+        const Cell *old_row = &front[row * _cols];
+        const Cell *new_row = &back[row * _cols];
+
+        int col = 0;
+        while (col < _cols) {
+            if (old_row[col] == new_row[col]) {
+                col++;
+                continue;
+            }
+
+            // Extend the span across short runs of unchanged cells.
+            int last = col;
+            for (int i = col + 1; i < _cols && i - last <= max_gap; i++) {
+                if (old_row[i] != new_row[i])
+                    last = i;
+            }
+
+            if (!changed) {
+                changed = true;
+                if (synchronized) output("\e[?2026h");
+                show_cursor(false);
+                output(sgr(face));
+            }
+
+            set_cursor_position(row, col);
+            for (; col <= last; col++) {
+                if (new_row[col].face != face) {
+                    face = new_row[col].face;
+                    output(sgr(face));
+                }
+                // The terminal moved past the tail with the character.
+                if (new_row[col].c == Cell::wide_tail)
+                    continue;
+                char32_t c = new_row[col].c;
+                if (c < 0x80) {
+                    char ascii = c;
+                    output(std::string_view(&ascii, 1));
+                } else {
+                    encoded.clear();
+                    encode_utf8(c, encoded);
+                    output(encoded);
+                }
+            }
+        }
+    }
+
+    if (changed) {
+        output(sgr(Face::Default));
+        if (synchronized) output("\e[?2026l");
+        front = back;
+    }
+    return changed;
+}
@@ -0,0 +1,68 @@
+#pragma once
+
+#include <cstdint>
+#include <string_view>
+#include <vector>
+
+enum class Face : std::uint8_t {
+    Default,
+    Keyword,
+    Comment,
+    Type,
+    Preprocessor
+};
+
+struct Cell {
+    // The right half of a double width character is `wide_tail`.
+    char32_t c = ' ';
+    Face face = Face::Default;
+
+    static constexpr char32_t wide_tail = 0;
+
+    bool operator==(const Cell &other) const { return c == other.c && face == other.face; }
+    bool operator!=(const Cell &other) const { return !(*this == other); }
+};
+
+/**
+ * Double buffered model of the terminal contents. Buffers draw into
+ * the back grid, `present()` then emits only the cells that differ
+ * from what is already on the terminal.
+ */
+class Screen {
+    int _rows = 0, _cols = 0;
+    // What is on the terminal, and what should be.
+    std::vector<Cell> front, back;
+public:
+    // Wrap updates in synchronized output mode, so terminals that
+    // support it never show a half drawn frame.
+    bool synchronized = true;
+
+    int rows() const { return _rows; }
+    int cols() const { return _cols; }
+
+    /**
+     * Resize both grids and clear the terminal, everything drawn
+     * afterwards is emitted in full.
+     */
+    void resize(int rows, int cols);
+
+    Cell &at(int row, int col) { return back[row * _cols + col]; }
+
+    /**
+     * Blank the cells in [col0, col1) on the given row.
+     */
+    void clear(int row, int col0, int col1);
+
+    /**
+     * Write the UTF-8 text `s` starting at (row, col), clipped at
+     * `max_col`, one codepoint per cell (two for wide characters).
+     * Returns the column following the last written cell.
+     */
+    int put(int row, int col, std::string_view s, Face face, int max_col);
+
+    /**
+     * Queue the escape sequences turning the terminal into the back
+     * grid. Returns true if anything changed.
+     */
+    bool present();
+};
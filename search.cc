@@ -0,0 +1,454 @@
+#include "search.hh"
+
+#include <algorithm>
+#include <chrono>
+#include <cctype>
+#include <cstdint>
+#include <cstring>
+#include <unistd.h>
+
+#include "buffer.hh"
+#include "frame.hh"
+#include "pool.hh"
+#include "simd.hh"
+#include "utf8.hh"
+
+static constexpr std::size_t npos = std::string_view::npos;
+
+static bool matches(const char *at, std::string_view needle) {
+    return std::memcmp(at, needle.data(), needle.size()) == 0;
+}
+
+/****************************************************************
+ * Scanning contiguous text. Each variant checks positions in blocks
+ * and leaves whatever doesn't fill a block to the scalar loop.
+ ****************************************************************/
+static std::size_t find_scalar(const char *data, std::size_t begin, std::size_t end,
+                               std::string_view needle) {
+    for (std::size_t i = begin; i < end; i++) {
+        if (data[i] == needle.front() && matches(data + i, needle))
+            return i;
+    }
+    return npos;
+}
+
+static std::size_t rfind_scalar(const char *data, std::size_t begin, std::size_t end,
+                                std::string_view needle) {
+    for (std::size_t i = end; i-- > begin;) {
+        if (data[i] == needle.front() && matches(data + i, needle))
+            return i;
+    }
+    return npos;
+}
+
+#ifdef HAVE_X86_SIMD
+// Bit i set if position i of the block may start a match.
+static inline uint32_t candidates_sse2(const char *at, std::size_t last, __m128i first, __m128i tail) {
+    __m128i a = _mm_loadu_si128(reinterpret_cast<const __m128i *>(at));
+    __m128i b = _mm_loadu_si128(reinterpret_cast<const __m128i *>(at + last));
+    return _mm_movemask_epi8(_mm_and_si128(_mm_cmpeq_epi8(a, first), _mm_cmpeq_epi8(b, tail)));
+}
+
+__attribute__((target("avx2")))
+static inline uint32_t candidates_avx2(const char *at, std::size_t last, __m256i first, __m256i tail) {
+    __m256i a = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(at));
+    __m256i b = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(at + last));
+    return _mm256_movemask_epi8(_mm256_and_si256(_mm256_cmpeq_epi8(a, first), _mm256_cmpeq_epi8(b, tail)));
+}
+
+// Positions [begin, end) are match candidates, `data + end + needle.size() - 1` is readable.
+static std::size_t find_sse2(const char *data, std::size_t begin, std::size_t end, std::string_view needle) {
+    const __m128i first = _mm_set1_epi8(needle.front());
+    const __m128i tail = _mm_set1_epi8(needle.back());
+    std::size_t i = begin;
+    for (; i + 16 <= end; i += 16) {
+        for (uint32_t mask = candidates_sse2(data + i, needle.size() - 1, first, tail); mask; mask &= mask - 1) {
+            std::size_t at = i + __builtin_ctz(mask);
+            if (matches(data + at, needle))
+                return at;
+        }
+    }
+    return find_scalar(data, i, end, needle);
+}
+
+static std::size_t rfind_sse2(const char *data, std::size_t begin, std::size_t end, std::string_view needle) {
+    const __m128i first = _mm_set1_epi8(needle.front());
+    const __m128i tail = _mm_set1_epi8(needle.back());
+    std::size_t i = end;
+    for (; i >= begin + 16; i -= 16) {
+        for (uint32_t mask = candidates_sse2(data + i - 16, needle.size() - 1, first, tail); mask;) {
+            int bit = 31 - __builtin_clz(mask);
+            std::size_t at = i - 16 + bit;
+            if (matches(data + at, needle))
+                return at;
+            mask &= ~(1u << bit);
+        }
+    }
+    return rfind_scalar(data, begin, i, needle);
+}
+
+__attribute__((target("avx2")))
+static std::size_t find_avx2(const char *data, std::size_t begin, std::size_t end, std::string_view needle) {
+    const __m256i first = _mm256_set1_epi8(needle.front());
+    const __m256i tail = _mm256_set1_epi8(needle.back());
+    std::size_t i = begin;
+    for (; i + 32 <= end; i += 32) {
+        for (uint32_t mask = candidates_avx2(data + i, needle.size() - 1, first, tail); mask; mask &= mask - 1) {
+            std::size_t at = i + __builtin_ctz(mask);
+            if (matches(data + at, needle))
+                return at;
+        }
+    }
+    return find_scalar(data, i, end, needle);
+}
+
+__attribute__((target("avx2")))
+static std::size_t rfind_avx2(const char *data, std::size_t begin, std::size_t end, std::string_view needle) {
+    const __m256i first = _mm256_set1_epi8(needle.front());
+    const __m256i tail = _mm256_set1_epi8(needle.back());
+    std::size_t i = end;
+    for (; i >= begin + 32; i -= 32) {
+        for (uint32_t mask = candidates_avx2(data + i - 32, needle.size() - 1, first, tail); mask;) {
+            int bit = 31 - __builtin_clz(mask);
+            std::size_t at = i - 32 + bit;
+            if (matches(data + at, needle))
+                return at;
+            mask &= ~(1u << bit);
+        }
+    }
+    return rfind_scalar(data, begin, i, needle);
+}
+#endif
+
+using Scan = std::size_t (*)(const char *, std::size_t, std::size_t, std::string_view);
+
+static const Scan find_block = simd_pick(SIMD_VARIANTS(find));
+static const Scan rfind_block = simd_pick(SIMD_VARIANTS(rfind));
+
+std::size_t find(std::string_view text, std::string_view needle) {
+    if (needle.empty())
+        return 0;
+    if (text.size() < needle.size())
+        return npos;
+    return find_block(text.data(), 0, text.size() - needle.size() + 1, needle);
+}
+
+std::size_t rfind(std::string_view text, std::string_view needle) {
+    if (needle.empty())
+        return text.size();
+    if (text.size() < needle.size())
+        return npos;
+    return rfind_block(text.data(), 0, text.size() - needle.size() + 1, needle);
+}
+
+/****************************************************************
+ * Scanning ropes.
+ ****************************************************************/
+
+/**
+ * Whether `needle` occurs at `offset`, which may run into later leaves.
+ */
+static bool matches_at(const RopeNode *root, std::size_t offset, std::string_view needle) {
+    if (offset + needle.size() > root->length)
+        return false;
+    RopeCursor cursor(root, offset);
+    while (!needle.empty()) {
+        std::string_view chunk = cursor.chunk();
+        std::size_t n = std::min(chunk.size(), needle.size());
+        if (chunk.substr(0, n) != needle.substr(0, n))
+            return false;
+        needle.remove_prefix(n);
+        cursor.next_chunk();
+    }
+    return true;
+}
+
+std::optional<std::size_t> find(const RopeNode *root, std::string_view needle, std::size_t from) {
+    if (from > root->length)
+        return std::nullopt;
+    if (needle.empty())
+        return from;
+
+    RopeCursor cursor(root, from);
+    while (!cursor.at_end()) {
+        std::string_view chunk = cursor.chunk();
+        std::size_t base = cursor.offset();
+
+        // Matches within the leaf come before those running past its end.
+        std::size_t at = find(chunk, needle);
+        if (at != npos)
+            return base + at;
+        std::size_t straddling = chunk.size() - std::min(chunk.size(), needle.size() - 1);
+        for (std::size_t i = straddling; i < chunk.size(); i++) {
+            if (chunk[i] == needle.front() && matches_at(root, base + i, needle))
+                return base + i;
+        }
+
+        cursor.next_chunk();
+    }
+    return std::nullopt;
+}
+
+std::optional<std::size_t> rfind(const RopeNode *root, std::string_view needle, std::size_t end) {
+    end = std::min(end, root->length + 1);
+    if (needle.empty())
+        return end > 0 ? std::optional<std::size_t>(end - 1) : std::nullopt;
+    if (end == 0)
+        return std::nullopt;
+
+    RopeCursor cursor(root, end - 1);
+    do {
+        std::string_view leaf = cursor.leaf_view();
+        std::size_t base = cursor.leaf_offset();
+        // Starts in [0, limit) of this leaf are before `end`.
+        std::size_t limit = std::min(leaf.size(), end - base);
+
+        // Matches running past the end of the leaf come after those within it.
+        std::size_t straddling = leaf.size() - std::min(leaf.size(), needle.size() - 1);
+        for (std::size_t i = limit; i-- > straddling;) {
+            if (leaf[i] == needle.front() && matches_at(root, base + i, needle))
+                return base + i;
+        }
+        std::size_t at = rfind(leaf.substr(0, std::min(straddling, limit) + needle.size() - 1), needle);
+        if (at != npos)
+            return base + at;
+    } while (cursor.prev_chunk());
+    return std::nullopt;
+}
+
+/**
+ * Matches on lines starting in [begin, end). Both are line starts, or
+ * the end of the rope.
+ */
+static std::vector<RegexMatch> find_all(const RopeNode *root, const Regex &regex,
+                                        std::size_t begin, std::size_t end) {
+    RegexMatcher matcher(regex);
+    std::vector<RegexMatch> matches;
+
+    std::size_t first_line = root->line_of_offset(begin);
+    // The last range includes the (maybe empty) line after the last newline.
+    std::size_t last_line = end == root->length ? root->line_count() : root->line_of_offset(end);
+
+    RopeCursor cursor(root, begin);
+    std::string_view chunk = cursor.chunk();
+    // Lines spanning leaves are copied together here.
+    std::string spill;
+    for (std::size_t line = first_line; line < last_line; line++) {
+        std::string_view text;
+        spill.clear();
+        bool spilled = false;
+        while (true) {
+            if (chunk.empty()) {
+                if (!cursor.next_chunk()) {
+                    text = spill;
+                    break;
+                }
+                chunk = cursor.chunk();
+                continue;
+            }
+            const char *newline = static_cast<const char *>(
+                std::memchr(chunk.data(), '\n', chunk.size()));
+            if (newline == nullptr) {
+                spill.append(chunk);
+                spilled = true;
+                chunk = {};
+                continue;
+            }
+
+            std::size_t length = newline - chunk.data();
+            text = chunk.substr(0, length);
+            chunk.remove_prefix(length + 1);
+            if (spilled) {
+                spill.append(text);
+                text = spill;
+            }
+            break;
+        }
+        matcher.find_all(text, line, matches);
+    }
+    return matches;
+}
+
+std::vector<RegexMatch> find_all(const RopeNode *root, const Regex &regex) {
+    // Not worth a task below this many bytes.
+    static constexpr std::size_t min_range = 1 << 16;
+
+    ThreadPool &pool = thread_pool();
+    std::size_t ranges = std::clamp<std::size_t>(root->length / min_range, 1, 4 * pool.size());
+
+    // Cut at the start of the line containing each even split point.
+    std::vector<std::size_t> cuts{0};
+    for (std::size_t i = 1; i < ranges; i++) {
+        std::size_t cut = root->offset_of_line(root->line_of_offset(root->length * i / ranges));
+        if (cut > cuts.back())
+            cuts.push_back(cut);
+    }
+    cuts.push_back(root->length);
+
+    std::vector<std::future<std::vector<RegexMatch>>> results;
+    for (std::size_t i = 0; i + 1 < cuts.size(); i++) {
+        std::size_t begin = cuts[i], end = cuts[i + 1];
+        results.push_back(pool.submit([root, &regex, begin, end] {
+            return find_all(root, regex, begin, end);
+        }));
+    }
+
+    std::vector<RegexMatch> matches;
+    for (auto &result : results) {
+        std::vector<RegexMatch> part = result.get();
+        matches.insert(matches.end(), part.begin(), part.end());
+    }
+    return matches;
+}
+
+/****************************************************************
+ * Incremental search.
+ ****************************************************************/
+void IncrementalSearch::start(Buffer &buffer, bool forward) {
+    _active = true;
+    _forward = forward;
+    _failing = false;
+    _needle.clear();
+    _origin_row = buffer._row;
+    _origin_col = buffer._col;
+    update_status();
+}
+
+void IncrementalSearch::search(Buffer &buffer, bool skip) {
+    _failing = !buffer.search(_needle, _forward, skip);
+    update_status();
+}
+
+void IncrementalSearch::update_status() {
+    std::string status = _failing ? "Failing I-search" : "I-search";
+    if (!_forward)
+        status += " backward";
+    active_frame().set_status(status + ": " + _needle);
+}
+
+bool IncrementalSearch::handle_key(Buffer &buffer, Key key) {
+    switch (key) {
+    case Key::CTRL_S:
+    case Key::CTRL_R:
+        _forward = key == Key::CTRL_S;
+        if (_needle.empty())
+            _needle = _last_needle;
+        search(buffer, true);
+        break;
+    case Key::BACKSPACE:
+        _needle.erase(prev_codepoint(_needle, _needle.size()));
+        buffer._row = _origin_row;
+        buffer._col = _origin_col;
+        search(buffer, false);
+        break;
+    case Key::CTRL_G:
+        buffer._row = _origin_row;
+        buffer._col = _origin_col;
+        // Fall through.
+    case Key::ENTER:
+    case Key::ESC:
+        _active = false;
+        if (!_needle.empty())
+            _last_needle = _needle;
+        active_frame().set_status("");
+        break;
+    default:
+        if (key >= 0x80 && key < 0x100) {
+            _needle += read_codepoint(STDIN_FILENO, key);
+            search(buffer, false);
+            break;
+        } else if (key < 0x80 && std::isprint(key)) {
+            _needle.push_back(key);
+            search(buffer, false);
+            break;
+        }
+        _active = false;
+        if (!_needle.empty())
+            _last_needle = _needle;
+        active_frame().set_status("");
+        return false;
+    }
+    buffer.scroll_to_cursor();
+    return true;
+}
+
+/****************************************************************
+ * Regular expression search.
+ ****************************************************************/
+void RegexSearch::start(Buffer &buffer) {
+    _active = true;
+    update_status();
+}
+
+void RegexSearch::update_status() {
+    active_frame().set_status("Regexp search: " + _pattern);
+}
+
+void RegexSearch::run(Buffer &buffer) {
+    std::optional<Regex> regex;
+    try {
+        regex.emplace(_pattern);
+    } catch (const std::invalid_argument &e) {
+        active_frame().set_status(std::string("Invalid regexp: ") + e.what());
+        return;
+    }
+
+    auto start = std::chrono::steady_clock::now();
+    std::vector<RegexMatch> matches = buffer.find_all(*regex);
+    auto elapsed = std::chrono::duration_cast<std::chrono::milliseconds>(
+        std::chrono::steady_clock::now() - start);
+
+    if (matches.empty()) {
+        active_frame().set_status("No matches for /" + _pattern + "/ (" +
+                                  std::to_string(elapsed.count()) + " ms)");
+        return;
+    }
+
+    // The first match after the cursor, wrapping around.
+    auto after = std::upper_bound(
+        matches.begin(), matches.end(), std::make_pair(buffer._row, buffer._col),
+        [](const std::pair<int, int> &cursor, const RegexMatch &match) {
+            return cursor < std::make_pair((int)match.line, (int)match.column);
+        });
+    if (after == matches.end())
+        after = matches.begin();
+    buffer._row = after->line;
+    buffer._col = after->column;
+    buffer.scroll_to_cursor();
+
+    active_frame().set_status("Match " + std::to_string(after - matches.begin() + 1) +
+                              " of " + std::to_string(matches.size()) +
+                              " for /" + _pattern + "/ (" +
+                              std::to_string(elapsed.count()) + " ms)");
+}
+
+bool RegexSearch::handle_key(Buffer &buffer, Key key) {
+    switch (key) {
+    case Key::BACKSPACE:
+        _pattern.erase(prev_codepoint(_pattern, _pattern.size()));
+        update_status();
+        break;
+    case Key::ENTER:
+        _active = false;
+        run(buffer);
+        break;
+    case Key::CTRL_G:
+        _active = false;
+        active_frame().set_status("");
+        break;
+    default:
+        if (key >= 0x80 && key < 0x100) {
+            _pattern += read_codepoint(STDIN_FILENO, key);
+            update_status();
+            break;
+        } else if (key < 0x80 && std::isprint(key)) {
+            _pattern.push_back(key);
+            update_status();
+            break;
+        }
+        _active = false;
+        active_frame().set_status("");
+        return false;
+    }
+    return true;
+}
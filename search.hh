@@ -0,0 +1,99 @@
+#pragma once
+
+#include <optional>
+#include <vector>
+#include <string>
+#include <string_view>
+
+#include "regex.hh"
+#include "rope.hh"
+#include "term.hh"
+
+/**
+ * First occurrence of `needle` in `text`, or `npos`.
+ *
+ * Candidates are filtered on the needle's first and last byte 32 (AVX2)
+ * or 16 (SSE2) positions at a time, picked at run time, only those are
+ * compared in full.
+ */
+std::size_t find(std::string_view text, std::string_view needle);
+
+/**
+ * Last occurrence of `needle` in `text`, or `npos`.
+ */
+std::size_t rfind(std::string_view text, std::string_view needle);
+
+/**
+ * Offset of the first occurrence of `needle` in `root` starting at or
+ * after `from`, scanning leaf by leaf. Matches may span leaves.
+ */
+std::optional<std::size_t> find(const RopeNode *root, std::string_view needle, std::size_t from);
+
+/**
+ * Offset of the last occurrence of `needle` in `root` starting before
+ * `end`.
+ */
+std::optional<std::size_t> rfind(const RopeNode *root, std::string_view needle, std::size_t end);
+
+/**
+ * Every match of `regex` in `root`, in document order.
+ *
+ * The rope is cut into line aligned ranges of roughly equal size, since
+ * matches never span lines no match crosses a cut. The ranges are
+ * scanned on `thread_pool()` and the results concatenated.
+ */
+std::vector<RegexMatch> find_all(const RopeNode *root, const Regex &regex);
+
+class Buffer;
+
+/**
+ * Incremental search, moving the cursor to matches as the search
+ * string is typed. C-s and C-r go to the next match forward and
+ * backward, enter accepts and C-g goes back to where the search
+ * started.
+ */
+class IncrementalSearch {
+    bool _active = false;
+    bool _forward = true;
+    bool _failing = false;
+    std::string _needle;
+    // The previous search, reused by C-s C-s.
+    std::string _last_needle;
+    int _origin_row = 0, _origin_col = 0;
+
+    void search(Buffer &buffer, bool skip);
+    void update_status();
+public:
+    bool active() const { return _active; }
+
+    void start(Buffer &buffer, bool forward);
+
+    /**
+     * Handle a key while active, returns false (ending the search) if
+     * it is not one of ours and should be handled as usual.
+     */
+    bool handle_key(Buffer &buffer, Key key);
+};
+
+/**
+ * Regular expression search, prompting for a pattern on the status
+ * line. Finds every match, reports their number and moves the cursor
+ * to the first one after it. C-f enter again goes to the next one.
+ */
+class RegexSearch {
+    bool _active = false;
+    std::string _pattern;
+
+    void run(Buffer &buffer);
+    void update_status();
+public:
+    bool active() const { return _active; }
+
+    void start(Buffer &buffer);
+
+    /**
+     * Handle a key while prompting, returns false (dismissing the
+     * prompt) if it is not one of ours and should be handled as usual.
+     */
+    bool handle_key(Buffer &buffer, Key key);
+};
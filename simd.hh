@@ -0,0 +1,48 @@
+#pragma once
+
+#include <vector>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define HAVE_X86_SIMD 1
+#endif
+
+/**
+ * Runtime dispatch between variants of a routine, named `name_avx2`,
+ * `name_sse2` and `name_scalar`. Only the scalar one needs to exist
+ * off x86, e.g.:
+ *
+ *     static const Scan scan = simd_pick(SIMD_VARIANTS(find));
+ */
+#ifdef HAVE_X86_SIMD
+#define SIMD_VARIANTS(name) name##_avx2, name##_sse2, name##_scalar
+#else
+#define SIMD_VARIANTS(name) decltype(&name##_scalar){}, decltype(&name##_scalar){}, name##_scalar
+#endif
+
+// The best variant the CPU supports, AVX2 over SSE2 over scalar.
+template<typename F>
+F simd_pick(F avx2, F sse2, F scalar) {
+#ifdef HAVE_X86_SIMD
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2"))
+        return avx2;
+    if (__builtin_cpu_supports("sse2"))
+        return sse2;
+#endif
+    return scalar;
+}
+
+// Every variant the CPU supports, scalar first, to check them against each other.
+template<typename F>
+std::vector<F> simd_supported(F avx2, F sse2, F scalar) {
+    std::vector<F> variants{scalar};
+#ifdef HAVE_X86_SIMD
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("sse2"))
+        variants.push_back(sse2);
+    if (__builtin_cpu_supports("avx2"))
+        variants.push_back(avx2);
+#endif
+    return variants;
+}
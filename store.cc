@@ -0,0 +1,35 @@
+#include "store.hh"
+
+#include <algorithm>
+#include <cstring>
+
+char *TextStore::allocate(std::size_t length) {
+    if (chunks.empty() || chunks.back().capacity - chunks.back().size < length) {
+        std::size_t capacity = std::max(chunk_size, length);
+        chunks.push_back({std::make_unique<char[]>(capacity), 0, capacity});
+    }
+
+    Chunk &chunk = chunks.back();
+    char *result = &chunk.data[chunk.size];
+    chunk.size += length;
+    return result;
+}
+
+const char *TextStore::append(const char *string, std::size_t length) {
+    char *result = allocate(length);
+    std::memcpy(result, string, length);
+    return result;
+}
+
+const char *TextStore::tail() const {
+    if (chunks.empty() || chunks.back().size == 0)
+        return nullptr;
+    return &chunks.back().data[chunks.back().size];
+}
+
+std::size_t TextStore::size() const {
+    std::size_t size = 0;
+    for (const Chunk &chunk : chunks)
+        size += chunk.size;
+    return size;
+}
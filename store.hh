@@ -0,0 +1,44 @@
+#pragma once
+
+#include <cstddef>
+#include <memory>
+#include <vector>
+
+/**
+ * Append-only text storage ("add buffer" in piece table terms) for
+ * text inserted into a rope. Appended text never moves, so leaves can
+ * point straight into it for as long as the store lives.
+ */
+class TextStore {
+    struct Chunk {
+        std::unique_ptr<char[]> data;
+        std::size_t size;
+        std::size_t capacity;
+    };
+    std::vector<Chunk> chunks;
+    std::size_t chunk_size;
+public:
+    TextStore(std::size_t chunk_size = 1 << 16) : chunk_size{chunk_size} {}
+
+    /**
+     * Reserve room for `length` characters at the end of the store,
+     * for the caller to fill in.
+     */
+    char *allocate(std::size_t length);
+
+    /**
+     * Copy `length` characters into the store, returning their new
+     * (stable) location.
+     */
+    const char *append(const char *string, std::size_t length);
+
+    /**
+     * Where the next append will end up if it fits in the current
+     * chunk, i.e. one past the last appended character. Null if there
+     * is nothing to append to.
+     */
+    const char *tail() const;
+
+    // Total number of characters appended.
+    std::size_t size() const;
+};
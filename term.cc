@@ -1,4 +1,5 @@
 #include "term.hh"
+#include "utf8.hh"
 
 #include <iostream>
 #include <string>
@@ -9,40 +10,71 @@
 #include <vector>
 #include <sstream>
 #include <termios.h>
+#include <cerrno>
+#include <cstdarg>
+#include <cstdio>
+#include <algorithm>
 
-#define escape(fmt, ...)                                                \
-    do {                                                                \
-        printf("\e[" fmt __VA_OPT__(,) __VA_ARGS__);                    \
-        fflush(stdout);                                                 \
-    } while(0)
+#define escape(fmt, ...) outputf("\e[" fmt __VA_OPT__(,) __VA_ARGS__)
 
-Key read_key(int fd) {
-    int count;
+// Input read ahead of what has been handed out so far.
+static std::string input_buffer;
+static std::size_t input_position = 0;
+
+/**
+ * Read a single byte, waiting at most the raw mode timeout. Returns
+ * false on timeout.
+ */
+static bool read_byte(int fd, char &c) {
+    if (input_position == input_buffer.size()) {
+        input_buffer.resize(4096);
+        ssize_t nread = read(fd, input_buffer.data(), input_buffer.size());
+        if (nread == -1 && errno != EAGAIN && errno != EINTR) exit(1);
+        input_buffer.resize(std::max<ssize_t>(nread, 0));
+        input_position = 0;
+        if (nread <= 0) return false;
+    }
+    c = input_buffer[input_position++];
+    return true;
+}
+
+bool input_pending(int fd) {
+    if (input_position < input_buffer.size()) return true;
+    int count = 0;
     ioctl(fd, FIONREAD, &count);
-    if (count == 0) return Key::KEY_NULL;
+    return count > 0;
+}
+
+Key read_key(int fd) {
+    if (!input_pending(fd)) return Key::KEY_NULL;
 
-    int nread;
-    char c, seq[3];
-    while ((nread = read(fd,&c,1)) == 0);
-    if (nread == -1) exit(1);
+    char c, seq[2];
+    if (!read_byte(fd, c)) return Key::KEY_NULL;
 
     while(1) {
         switch(c) {
         case ESC:    /* escape sequence */
             /* If this is just an ESC, we'll timeout here. */
-            if (read(fd,seq,1) == 0) return Key::ESC;
-            if (read(fd,seq+1,1) == 0) return Key::ESC;
+            if (!read_byte(fd, seq[0])) return Key::ESC;
+            if (!read_byte(fd, seq[1])) return Key::ESC;
 
             /* ESC [ sequences. */
             if (seq[0] == '[') {
                 if (seq[1] >= '0' && seq[1] <= '9') {
-                    /* Extended escape, read additional byte. */
-                    if (read(fd,seq+2,1) == 0) return Key::ESC;
-                    if (seq[2] == '~') {
-                        switch(seq[1]) {
-                        case '3': return Key::DEL_KEY;
-                        case '5': return Key::PAGE_UP;
-                        case '6': return Key::PAGE_DOWN;
+                    /* Extended escape, read the rest of the number. */
+                    int code = seq[1] - '0';
+                    char d;
+                    while (true) {
+                        if (!read_byte(fd, d)) return Key::ESC;
+                        if (d < '0' || d > '9') break;
+                        code = code * 10 + (d - '0');
+                    }
+                    if (d == '~') {
+                        switch(code) {
+                        case 3: return Key::DEL_KEY;
+                        case 5: return Key::PAGE_UP;
+                        case 6: return Key::PAGE_DOWN;
+                        case 200: return Key::PASTE_START;
                         }
                     }
                 } else {
@@ -66,9 +98,73 @@ Key read_key(int fd) {
             }
             break;
         default:
-            return (Key)c;
+            return (Key)(unsigned char)c;
+        }
+    }
+}
+
+std::string read_codepoint(int fd, Key lead) {
+    std::string result(1, (char)lead);
+    // Only wait for as many continuation bytes as the lead announces.
+    int expected = lead >= 0xf0 ? 3 : lead >= 0xe0 ? 2 : lead >= 0xc0 ? 1 : 0;
+    char c;
+    while (expected-- > 0 && read_byte(fd, c)) {
+        if (is_codepoint_start(c)) {
+            // Start of the next key, leave it for `read_key()`.
+            input_position--;
+            break;
+        }
+        result += c;
+    }
+    return result;
+}
+
+std::string read_paste(int fd) {
+    static constexpr std::string_view paste_end = "\e[201~";
+
+    // Give up on the end marker after this many timed out reads (of
+    // 100 ms each) in a row, in case the terminal dropped it.
+    static constexpr int max_idle_reads = 10;
+
+    std::string paste;
+    std::size_t searched = 0;
+    int idle_reads = 0;
+    while (idle_reads < max_idle_reads) {
+        paste.append(input_buffer, input_position);
+        input_buffer.clear();
+        input_position = 0;
+
+        std::size_t end = paste.find(paste_end, searched);
+        if (end != std::string::npos) {
+            // Whatever follows the paste is left for `read_key()`.
+            input_buffer = paste.substr(end + paste_end.size());
+            paste.resize(end);
+            break;
+        }
+        searched = paste.size() - std::min(paste.size(), paste_end.size() - 1);
+
+        // Pastes can be large, read straight into them.
+        std::size_t size = paste.size();
+        paste.resize(size + (1 << 16));
+        ssize_t nread = read(fd, paste.data() + size, paste.size() - size);
+        if (nread == -1 && errno != EAGAIN && errno != EINTR) exit(1);
+        paste.resize(size + std::max<ssize_t>(nread, 0));
+        idle_reads = nread > 0 ? 0 : idle_reads + 1;
+    }
+
+    // Terminals send line breaks in pastes as they would the enter key.
+    std::size_t out = 0;
+    for (std::size_t in = 0; in < paste.size(); in++) {
+        if (paste[in] == '\r') {
+            paste[out++] = '\n';
+            if (in + 1 < paste.size() && paste[in + 1] == '\n')
+                in++;
+        } else {
+            paste[out++] = paste[in];
         }
     }
+    paste.resize(out);
+    return paste;
 }
 
 struct std::pair<int, int> get_term_size() {
@@ -77,11 +173,52 @@ struct std::pair<int, int> get_term_size() {
     return { window_size.ws_row, window_size.ws_col };
 }
 
+/****************************************************************
+ * Output buffering:
+ ****************************************************************/
+static std::string output_buffer;
+
+void output(std::string_view s) {
+    output_buffer.append(s);
+}
+
+void outputf(const char *fmt, ...) {
+    char buf[256];
+    va_list args, retry;
+    va_start(args, fmt);
+    va_copy(retry, args);
+    int n = vsnprintf(buf, sizeof(buf), fmt, args);
+    if (n < (int)sizeof(buf)) {
+        output_buffer.append(buf, n);
+    } else if (n > 0) {
+        std::size_t size = output_buffer.size();
+        output_buffer.resize(size + n + 1);
+        vsnprintf(&output_buffer[size], n + 1, fmt, retry);
+        output_buffer.resize(size + n);
+    }
+    va_end(retry);
+    va_end(args);
+}
+
+void flush_output() {
+    if (output_buffer.empty()) return;
+
+    std::size_t written = 0;
+    while (written < output_buffer.size()) {
+        ssize_t n = write(STDOUT_FILENO, output_buffer.data() + written,
+                          output_buffer.size() - written);
+        if (n == -1 && errno == EINTR) continue;
+        if (n == -1) break;
+        written += n;
+    }
+    output_buffer.clear();
+}
+
 /****************************************************************
  * Terminal interaction:
  ****************************************************************/
 void set_cursor_position(int row, int col) {
-    escape("\e[%d;%df", row + 1, col + 1);
+    escape("%d;%df", row + 1, col + 1);
 }
 
 void show_cursor(bool show) {
@@ -89,6 +226,11 @@ void show_cursor(bool show) {
     else escape("?25l");
 }
 
+void bracketed_paste(bool enable) {
+    if (enable) escape("?2004h");
+    else escape("?2004l");
+}
+
 void clear(ClearOpt what) {
     switch (what) {
     case ClearOpt::LineRight: escape("0K"); break;
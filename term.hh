@@ -1,5 +1,7 @@
 #pragma once
 
+#include <string>
+#include <string_view>
 #include <utility>
 
 enum Key : int {
@@ -9,14 +11,17 @@ enum Key : int {
         CTRL_D = 4,         /* Ctrl-d */
         CTRL_E = 5,         /* Ctrl-e */
         CTRL_F = 6,         /* Ctrl-f */
+        CTRL_G = 7,         /* Ctrl-g */
         CTRL_H = 8,         /* Ctrl-h */
         CTRL_K = 11,        /* Ctrl-k */
         TAB = 9,            /* Tab */
         CTRL_L = 12,        /* Ctrl+l */
         ENTER = 13,         /* Enter */
         CTRL_Q = 17,        /* Ctrl-q */
+        CTRL_R = 18,        /* Ctrl-r */
         CTRL_S = 19,        /* Ctrl-s */
         CTRL_U = 21,        /* Ctrl-u */
+        CTRL_X = 24,        /* Ctrl-x */
         ESC = 27,           /* Escape */
         BACKSPACE =  127,   /* Backspace */
         /* The following are just soft codes, not really reported by the
@@ -29,13 +34,42 @@ enum Key : int {
         HOME_KEY,
         END_KEY,
         PAGE_UP,
-        PAGE_DOWN
+        PAGE_DOWN,
+        /* Start of bracketed paste, see `read_paste()`. */
+        PASTE_START
 };
 
+// Bytes above 0x7f are returned as keys as they are, see `read_codepoint()`.
 Key read_key(int fd);
 
+/**
+ * The UTF-8 sequence started by `lead` (a byte above 0x7f returned by
+ * `read_key()`), reading its continuation bytes.
+ */
+std::string read_codepoint(int fd, Key lead);
+
+// True if `read_key()` has something to read without waiting.
+bool input_pending(int fd);
+
+/**
+ * Read pasted text up to the end of the bracketed paste, or until
+ * nothing arrived for a second, with line endings turned into '\n'.
+ * Call after `read_key()` returned `PASTE_START`.
+ */
+std::string read_paste(int fd);
+
 struct std::pair<int, int> get_term_size();
 
+/****************************************************************
+ * Output buffering:
+ ****************************************************************/
+// Queue output for the terminal, nothing is written until `flush_output()`.
+void output(std::string_view s);
+void outputf(const char *fmt, ...) __attribute__((format(printf, 1, 2)));
+
+// Write all queued output with a single write().
+void flush_output();
+
 /****************************************************************
  * Terminal interaction:
  ****************************************************************/
@@ -48,6 +82,9 @@ void set_cursor_position(int row, int col);
 
 void show_cursor(bool show);
 
+// Have the terminal frame pasted text, see `read_paste()`.
+void bracketed_paste(bool enable);
+
 enum class ClearOpt {
     // Clear line right of cursor.
     LineRight,
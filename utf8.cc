@@ -0,0 +1,246 @@
+#include "utf8.hh"
+
+#include <algorithm>
+#include <cstdint>
+#include <iterator>
+
+#include "simd.hh"
+
+/****************************************************************
+ * Skipping ASCII, a block at a time by its sign bits.
+ ****************************************************************/
+static std::size_t ascii_prefix_scalar(const char *s, std::size_t length) {
+    std::size_t i = 0;
+    while (i < length && (unsigned char)s[i] < 0x80)
+        i++;
+    return i;
+}
+
+#ifdef HAVE_X86_SIMD
+static std::size_t ascii_prefix_sse2(const char *s, std::size_t length) {
+    std::size_t i = 0;
+    for (; i + 16 <= length; i += 16) {
+        uint32_t mask = _mm_movemask_epi8(_mm_loadu_si128(reinterpret_cast<const __m128i *>(s + i)));
+        if (mask)
+            return i + __builtin_ctz(mask);
+    }
+    return i + ascii_prefix_scalar(s + i, length - i);
+}
+
+__attribute__((target("avx2")))
+static std::size_t ascii_prefix_avx2(const char *s, std::size_t length) {
+    std::size_t i = 0;
+    for (; i + 32 <= length; i += 32) {
+        uint32_t mask = _mm256_movemask_epi8(_mm256_loadu_si256(reinterpret_cast<const __m256i *>(s + i)));
+        if (mask)
+            return i + __builtin_ctz(mask);
+    }
+    return i + ascii_prefix_scalar(s + i, length - i);
+}
+#endif
+
+using Scan = std::size_t (*)(const char *, std::size_t);
+
+std::size_t ascii_prefix(const char *s, std::size_t length) {
+    static const Scan scan = simd_pick(SIMD_VARIANTS(ascii_prefix));
+    return scan(s, length);
+}
+
+std::vector<std::size_t> ascii_prefix_each(const char *s, std::size_t length) {
+    std::vector<std::size_t> prefixes;
+    for (Scan scan : simd_supported(SIMD_VARIANTS(ascii_prefix)))
+        prefixes.push_back(scan(s, length));
+    return prefixes;
+}
+
+/****************************************************************
+ * Codepoints.
+ ****************************************************************/
+
+/**
+ * Length of the sequence `lead` starts (0 if it can't start one) and
+ * the range of its first continuation byte, excluding overlong forms,
+ * surrogates and codepoints past U+10FFFF.
+ */
+static int sequence_length(unsigned char lead, unsigned char &low, unsigned char &high) {
+    low = 0x80;
+    high = 0xbf;
+    if (lead < 0x80)
+        return 1;
+    if (lead >= 0xc2 && lead <= 0xdf)
+        return 2;
+    if (lead >= 0xe0 && lead <= 0xef) {
+        if (lead == 0xe0) low = 0xa0;
+        if (lead == 0xed) high = 0x9f;
+        return 3;
+    }
+    if (lead >= 0xf0 && lead <= 0xf4) {
+        if (lead == 0xf0) low = 0x90;
+        if (lead == 0xf4) high = 0x8f;
+        return 4;
+    }
+    return 0;
+}
+
+char32_t decode_utf8(std::string_view s, std::size_t &at) {
+    std::size_t start = at++;
+    while (at < s.size() && !is_codepoint_start(s[at]))
+        at++;
+
+    unsigned char lead = s[start], low, high;
+    int length = sequence_length(lead, low, high);
+    if (length == 0 || (std::size_t)length != at - start)
+        return replacement_character;
+    if (length == 1)
+        return lead;
+
+    unsigned char first = s[start + 1];
+    if (first < low || first > high)
+        return replacement_character;
+    char32_t c = lead & (0x7f >> length);
+    for (int i = 1; i < length; i++)
+        c = c << 6 | (s[start + i] & 0x3f);
+    return c;
+}
+
+void encode_utf8(char32_t c, std::string &out) {
+    if (c < 0x80) {
+        out += (char)c;
+    } else if (c < 0x800) {
+        out += (char)(0xc0 | c >> 6);
+        out += (char)(0x80 | (c & 0x3f));
+    } else if (c < 0x10000) {
+        out += (char)(0xe0 | c >> 12);
+        out += (char)(0x80 | (c >> 6 & 0x3f));
+        out += (char)(0x80 | (c & 0x3f));
+    } else {
+        out += (char)(0xf0 | c >> 18);
+        out += (char)(0x80 | (c >> 12 & 0x3f));
+        out += (char)(0x80 | (c >> 6 & 0x3f));
+        out += (char)(0x80 | (c & 0x3f));
+    }
+}
+
+std::size_t next_codepoint(std::string_view s, std::size_t at) {
+    if (at >= s.size())
+        return s.size();
+    while (++at < s.size() && !is_codepoint_start(s[at]));
+    return at;
+}
+
+std::size_t prev_codepoint(std::string_view s, std::size_t at) {
+    if (at == 0)
+        return 0;
+    while (--at > 0 && !is_codepoint_start(s[at]));
+    return at;
+}
+
+/****************************************************************
+ * Display width.
+ ****************************************************************/
+struct Range { char32_t first, last; };
+
+// Combining marks and other zero width characters (the common blocks).
+static constexpr Range zero_width[] = {
+    {0x0300, 0x036f}, {0x0483, 0x0489}, {0x0591, 0x05bd}, {0x05bf, 0x05bf},
+    {0x05c1, 0x05c2}, {0x05c4, 0x05c5}, {0x05c7, 0x05c7}, {0x0610, 0x061a},
+    {0x064b, 0x065f}, {0x0670, 0x0670}, {0x06d6, 0x06dc}, {0x06df, 0x06e4},
+    {0x0900, 0x0902}, {0x093a, 0x093a}, {0x093c, 0x093c}, {0x0941, 0x0948},
+    {0x094d, 0x094d}, {0x0951, 0x0957}, {0x0e31, 0x0e31}, {0x0e34, 0x0e3a},
+    {0x0e47, 0x0e4e}, {0x1ab0, 0x1aff}, {0x1dc0, 0x1dff}, {0x200b, 0x200f},
+    {0x202a, 0x202e}, {0x2060, 0x2064}, {0x20d0, 0x20ff}, {0xfe00, 0xfe0f},
+    {0xfe20, 0xfe2f}, {0xfeff, 0xfeff}, {0xe0100, 0xe01ef},
+};
+
+// East Asian wide and fullwidth characters, and emoji.
+static constexpr Range double_width[] = {
+    {0x1100, 0x115f}, {0x231a, 0x231b}, {0x2329, 0x232a}, {0x23e9, 0x23ec},
+    {0x25fd, 0x25fe}, {0x2614, 0x2615}, {0x2648, 0x2653}, {0x26aa, 0x26ab},
+    {0x26bd, 0x26be}, {0x26c4, 0x26c5}, {0x26f2, 0x26f3}, {0x2705, 0x2705},
+    {0x270a, 0x270b}, {0x274c, 0x274c}, {0x2753, 0x2755}, {0x2795, 0x2797},
+    {0x2b1b, 0x2b1c}, {0x2e80, 0x303e}, {0x3041, 0x33ff}, {0x3400, 0x4dbf},
+    {0x4e00, 0x9fff}, {0xa000, 0xa4cf}, {0xa960, 0xa97f}, {0xac00, 0xd7a3},
+    {0xf900, 0xfaff}, {0xfe10, 0xfe19}, {0xfe30, 0xfe6f}, {0xff00, 0xff60},
+    {0xffe0, 0xffe6}, {0x16fe0, 0x18cff}, {0x1b000, 0x1b2ff}, {0x1f004, 0x1f004},
+    {0x1f0cf, 0x1f0cf}, {0x1f18e, 0x1f18e}, {0x1f191, 0x1f19a}, {0x1f200, 0x1f251},
+    {0x1f300, 0x1f64f}, {0x1f680, 0x1f6ff}, {0x1f900, 0x1f9ff}, {0x1fa70, 0x1faff},
+    {0x20000, 0x2fffd}, {0x30000, 0x3fffd},
+};
+
+template<std::size_t N>
+static bool in(const Range (&ranges)[N], char32_t c) {
+    auto it = std::upper_bound(std::begin(ranges), std::end(ranges), c,
+                               [](char32_t c, const Range &range) { return c < range.first; });
+    return it != std::begin(ranges) && c <= std::prev(it)->last;
+}
+
+int codepoint_width(char32_t c) {
+    if (c < 0x300)
+        return 1;
+    if (in(zero_width, c))
+        return 0;
+    if (in(double_width, c))
+        return 2;
+    return 1;
+}
+
+/**
+ * Length of the ASCII prefix of `s`, less its last character if stray
+ * continuation bytes follow, which make it a codepoint of its own.
+ */
+static std::size_t ascii_codepoints(std::string_view s) {
+    std::size_t ascii = ascii_prefix(s.data(), s.size());
+    if (ascii > 0 && ascii < s.size() && !is_codepoint_start(s[ascii]))
+        ascii--;
+    return ascii;
+}
+
+std::size_t display_width(std::string_view s) {
+    std::size_t ascii = ascii_codepoints(s);
+    std::size_t width = ascii;
+    for (std::size_t at = ascii; at < s.size();)
+        width += codepoint_width(decode_utf8(s, at));
+    return width;
+}
+
+std::size_t offset_of_column(std::string_view s, std::size_t column) {
+    std::size_t ascii = ascii_codepoints(s);
+    if (column < ascii)
+        return column;
+
+    // Marks following the column's character go with it.
+    std::size_t width = ascii, at = ascii;
+    while (at < s.size()) {
+        std::size_t next = at;
+        std::size_t w = codepoint_width(decode_utf8(s, next));
+        if (width + w > column && w > 0)
+            break;
+        width += w;
+        at = next;
+    }
+    return at;
+}
+
+/****************************************************************
+ * Validation.
+ ****************************************************************/
+void Utf8Validator::feed(std::string_view text) {
+    const char *s = text.data(), *end = s + text.size();
+    while (s < end && !_failed) {
+        if (_pending == 0) {
+            s += ascii_prefix(s, end - s);
+            if (s == end)
+                break;
+            _pending = sequence_length(*s++, _low, _high) - 1;
+            if (_pending < 0)
+                _failed = true;
+        } else {
+            unsigned char c = *s++;
+            if (c < _low || c > _high)
+                _failed = true;
+            _low = 0x80;
+            _high = 0xbf;
+            _pending--;
+        }
+    }
+}
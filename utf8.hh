@@ -0,0 +1,79 @@
+#pragma once
+
+#include <cstddef>
+#include <string>
+#include <string_view>
+#include <vector>
+
+/****************************************************************
+ * UTF-8 text. A codepoint starts at every byte that isn't a
+ * continuation byte (10xxxxxx), stray continuation bytes belong to the
+ * codepoint before them. That way any byte string has a well defined
+ * layout, sequences that don't decode are shown as U+FFFD.
+ ****************************************************************/
+
+constexpr char32_t replacement_character = 0xFFFD;
+
+inline bool is_codepoint_start(char c) { return (c & 0xC0) != 0x80; }
+
+/**
+ * Length of the all ASCII prefix of `s`, scanning 32 (AVX2) or 16
+ * (SSE2) bytes at a time.
+ */
+std::size_t ascii_prefix(const char *s, std::size_t length);
+
+// `ascii_prefix()` by each variant the CPU supports, scalar first.
+std::vector<std::size_t> ascii_prefix_each(const char *s, std::size_t length);
+
+/**
+ * Decode the codepoint starting at `at`, moving `at` to the start of
+ * the next one.
+ */
+char32_t decode_utf8(std::string_view s, std::size_t &at);
+
+// Append the UTF-8 encoding of `c` to `out`.
+void encode_utf8(char32_t c, std::string &out);
+
+// Start of the codepoint after (or before) the one starting at `at`.
+std::size_t next_codepoint(std::string_view s, std::size_t at);
+std::size_t prev_codepoint(std::string_view s, std::size_t at);
+
+/**
+ * Terminal columns taken up by `c`: 2 for wide (e.g. CJK) characters,
+ * 0 for combining marks, otherwise 1. Control characters are shown as
+ * a blank.
+ */
+int codepoint_width(char32_t c);
+
+// Columns taken up by `s`.
+std::size_t display_width(std::string_view s);
+
+/**
+ * Offset of the codepoint shown at `column`, or of the one straddling
+ * it, in `s`. `s.size()` if `s` is narrower.
+ */
+std::size_t offset_of_column(std::string_view s, std::size_t column);
+
+/**
+ * Checks text fed to it in arbitrary pieces (e.g. rope leaves) is
+ * valid UTF-8, skipping over ASCII with `ascii_prefix()`.
+ */
+class Utf8Validator {
+    // Continuation bytes still expected, and the range of the next one.
+    int _pending = 0;
+    unsigned char _low = 0x80, _high = 0xbf;
+    bool _failed = false;
+public:
+    void feed(std::string_view text);
+
+    // True once an invalid sequence was seen.
+    bool failed() const { return _failed; }
+    // True if everything fed so far is valid and complete.
+    bool valid() const { return !_failed && _pending == 0; }
+};
+
+inline bool valid_utf8(std::string_view s) {
+    Utf8Validator validator;
+    validator.feed(s);
+    return validator.valid();
+}